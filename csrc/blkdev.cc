@@ -4,15 +4,6 @@
 #include <cinttypes>
 #include <cstdio>
 
-void BlockDevice::host_thread(void *arg)
-{
-    BlockDevice *bdev = static_cast<BlockDevice*>(arg);
-    bdev->run();
-
-    while (true)
-        bdev->target->switch_to();
-}
-
 BlockDevice::BlockDevice(const char *filename, uint32_t ntags)
     : _ntags(ntags)
 {
@@ -36,8 +27,7 @@ BlockDevice::BlockDevice(const char *filename, uint32_t ntags)
 
     write_trackers.resize(ntags);
 
-    target = context_t::current();
-    host.init(host_thread, this);
+    host.start([this] { run(); });
 }
 
 BlockDevice::~BlockDevice(void)
@@ -179,7 +169,9 @@ void BlockDevice::run(void)
             handle_data(req_data.front());
             req_data.pop();
         }
-        this->target->switch_to();
+        host_task_t::await([this] {
+            return !requests.empty() || !req_data.empty();
+        });
     }
 }
 
@@ -1,7 +1,7 @@
 #include <vector>
 #include <queue>
 #include <cstdlib>
-#include <fesvr/context.h>
+#include <fesvr/host_task.h>
 #include <cstdint>
 
 #define SECTOR_SIZE 512
@@ -58,7 +58,10 @@ class BlockDevice {
     void send_data(struct blkdev_data &data);
     struct blkdev_data recv_response(void);
 
-    void switch_to_host() { host.switch_to(); }
+    // The host only ever works off queued requests and data, so it awaits
+    // some and is resumed once there are rather than on every tick. Data
+    // waiting for its write request keeps it being resumed every tick.
+    void switch_to_host() { host.poll(); }
 
   private:
     uint32_t _ntags;
@@ -74,9 +77,7 @@ class BlockDevice {
     bool can_accept(struct blkdev_data &data);
     void handle_data(struct blkdev_data &data);
 
-    static void host_thread(void *arg);
     void run(void);
 
-    context_t* target;
-    context_t host;
+    host_task_t host;
 };
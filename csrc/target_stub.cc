@@ -0,0 +1,335 @@
+#include "target_stub.h"
+#include <fesvr/encoding.h>
+#include <algorithm>
+#include <string.h>
+
+#define CLINT_MSIP_BASE 0x2000000
+
+// Mailbox at the start of the scratch area, all fields 64 bits wide
+#define STUB_READY  0x00 // set by hart 0 once it runs the monitor
+#define STUB_CMD    0x08 // written by the host, cleared by the monitor when done
+#define STUB_ARG0   0x10
+#define STUB_ARG1   0x18
+#define STUB_ARG2   0x20
+#define STUB_RESULT 0x28
+#define STUB_DTB    0x30 // a1 as handed over by the bootrom
+#define STUB_BOOT   0x38 // releases the other harts to DRAM_BASE
+#define STUB_CODE   0x40
+
+// Round trips the host waits for hart 0 to check in after its MSIP, and for
+// a command to complete. Counted in polls rather than time, so a descheduled
+// host doesn't give up on a monitor that is merely slow to be looked at.
+#define STUB_START_POLLS 1000
+#define STUB_CALL_POLLS  (1 << 20)
+
+#define RV_X(x, s, n) \
+  (((x) >> (s)) & ((1 << (n)) - 1))
+#define T0 5
+#define AUIPC(dst, imm) (0x17 | ((dst) << 7) | (uint32_t)(RV_X(imm, 0, 20) << 12))
+#define JALR(dst, base, imm) (0x67 | ((dst) << 7) | ((base) << 15) | (uint32_t)(RV_X(imm, 0, 12) << 20))
+
+// RV64I, no compressed instructions. Entered from DRAM_BASE with a0/a1 as
+// set up by the bootrom. s0 holds the mailbox base throughout. Machine
+// interrupts stay masked while in the monitor (saved in s1/s2), so the boot
+// MSIP is polled for instead of trapping into the bootrom, and every way out
+// runs fence.i before jumping to DRAM_BASE.
+static const uint32_t stub_code[] = {
+  // entry:
+  0x300474f3, // csrrci s1, mstatus, 8
+  0x30447973, // csrrci s2, mie, 8
+  0x00000417, // auipc s0, 0
+  0xfb840413, // addi s0, s0, -72
+  0xf14022f3, // csrr t0, mhartid
+  0x00229313, // slli t1, t0, 2
+  0x020003b7, // lui t2, 8192
+  0x00730333, // add t1, t1, t2
+  0x00032023, // sw zero, 0(t1)
+  // ack:
+  0x34402373, // csrr t1, mip
+  0x00837313, // andi t1, t1, 8
+  0xfe031ce3, // bnez t1, ack
+  0x08029263, // bnez t0, park
+  0x02b43823, // sd a1, 48(s0)
+  0x00100293, // li t0, 1
+  0x00543023, // sd t0, 0(s0)
+  // loop:
+  0x344022f3, // csrr t0, mip
+  0x0082f293, // andi t0, t0, 8
+  0x04029263, // bnez t0, boot
+  0x00843283, // ld t0, 8(s0)
+  0xfe0288e3, // beqz t0, loop
+  0x01043603, // ld a2, 16(s0)
+  0x01843683, // ld a3, 24(s0)
+  0x02043703, // ld a4, 32(s0)
+  0xfff00793, // li a5, -1
+  0x00100313, // li t1, 1
+  0x06628863, // beq t0, t1, lz4
+  0x00200313, // li t1, 2
+  0x10628a63, // beq t0, t1, memset
+  0x00300313, // li t1, 3
+  0x14628863, // beq t0, t1, crc32
+  // done:
+  0x02f43423, // sd a5, 40(s0)
+  0x0330000f, // fence rw, rw
+  0x00043423, // sd zero, 8(s0)
+  0xfb9ff06f, // j loop
+  // boot:
+  0x020002b7, // lui t0, 8192
+  0x0002a023, // sw zero, 0(t0)
+  // boot_ack:
+  0x344022f3, // csrr t0, mip
+  0x0082f293, // andi t0, t0, 8
+  0xfe029ce3, // bnez t0, boot_ack
+  0x00100293, // li t0, 1
+  0x02543c23, // sd t0, 56(s0)
+  0x03043583, // ld a1, 48(s0)
+  0x00000513, // li a0, 0
+  0x00c0006f, // j jump_dram
+  // park:
+  0x03843283, // ld t0, 56(s0)
+  0xfe028ee3, // beqz t0, park
+  // jump_dram:
+  0x0330000f, // fence rw, rw
+  0x0000100f, // fence.i
+  0x30491073, // csrw mie, s2
+  0x30049073, // csrw mstatus, s1
+  0x00100293, // li t0, 1
+  0x01f29293, // slli t0, t0, 31
+  0x00028067, // jr t0
+  // lz4:
+  0x00d60fb3, // add t6, a2, a3
+  0x00070f13, // mv t5, a4
+  0x00f00e93, // li t4, 15
+  0x0ff00e13, // li t3, 255
+  // lz4_seq:
+  0x09f67a63, // bgeu a2, t6, lz4_done
+  0x00064283, // lbu t0, 0(a2)
+  0x00160613, // addi a2, a2, 1
+  0x0042d313, // srli t1, t0, 4
+  0x01d31a63, // bne t1, t4, lz4_lit
+  // lz4_litext:
+  0x00064383, // lbu t2, 0(a2)
+  0x00160613, // addi a2, a2, 1
+  0x00730333, // add t1, t1, t2
+  0xffc38ae3, // beq t2, t3, lz4_litext
+  // lz4_lit:
+  0x00030e63, // beqz t1, lz4_lit_end
+  // lz4_litcopy:
+  0x00064383, // lbu t2, 0(a2)
+  0x00770023, // sb t2, 0(a4)
+  0x00160613, // addi a2, a2, 1
+  0x00170713, // addi a4, a4, 1
+  0xfff30313, // addi t1, t1, -1
+  0xfe0316e3, // bnez t1, lz4_litcopy
+  // lz4_lit_end:
+  0x05f67a63, // bgeu a2, t6, lz4_done
+  0x00064303, // lbu t1, 0(a2)
+  0x00164383, // lbu t2, 1(a2)
+  0x00839393, // slli t2, t2, 8
+  0x00736333, // or t1, t1, t2
+  0x00260613, // addi a2, a2, 2
+  0x40670333, // sub t1, a4, t1
+  0x00f2f293, // andi t0, t0, 15
+  0x01d29a63, // bne t0, t4, lz4_match
+  // lz4_matchext:
+  0x00064383, // lbu t2, 0(a2)
+  0x00160613, // addi a2, a2, 1
+  0x007282b3, // add t0, t0, t2
+  0xffc38ae3, // beq t2, t3, lz4_matchext
+  // lz4_match:
+  0x00428293, // addi t0, t0, 4
+  // lz4_matchcopy:
+  0x00034383, // lbu t2, 0(t1)
+  0x00770023, // sb t2, 0(a4)
+  0x00130313, // addi t1, t1, 1
+  0x00170713, // addi a4, a4, 1
+  0xfff28293, // addi t0, t0, -1
+  0xfe0296e3, // bnez t0, lz4_matchcopy
+  0xf71ff06f, // j lz4_seq
+  // lz4_done:
+  0x41e707b3, // sub a5, a4, t5
+  0xefdff06f, // j done
+  // memset:
+  0x00d60fb3, // add t6, a2, a3
+  0x00068793, // mv a5, a3
+  // memset_head:
+  0x00767293, // andi t0, a2, 7
+  0x00028a63, // beqz t0, memset_body
+  0xeff674e3, // bgeu a2, t6, done
+  0x00060023, // sb zero, 0(a2)
+  0x00160613, // addi a2, a2, 1
+  0xfedff06f, // j memset_head
+  // memset_body:
+  0x00860313, // addi t1, a2, 8
+  0x006fe863, // bltu t6, t1, memset_tail
+  0x00063023, // sd zero, 0(a2)
+  0x00860613, // addi a2, a2, 8
+  0xff1ff06f, // j memset_body
+  // memset_tail:
+  0xedf672e3, // bgeu a2, t6, done
+  0x00060023, // sb zero, 0(a2)
+  0x00160613, // addi a2, a2, 1
+  0xff5ff06f, // j memset_tail
+  // crc32:
+  0x00000e17, // auipc t3, 0
+  0x050e0e13, // addi t3, t3, 80 (crc_table)
+  0x00d60fb3, // add t6, a2, a3
+  0xfff00793, // li a5, -1
+  0x0207d793, // srli a5, a5, 32
+  // crc32_byte:
+  0x03f67663, // bgeu a2, t6, crc32_done
+  0x00064283, // lbu t0, 0(a2)
+  0x00160613, // addi a2, a2, 1
+  0x00f2c2b3, // xor t0, t0, a5
+  0x0ff2f293, // andi t0, t0, 255
+  0x00229293, // slli t0, t0, 2
+  0x01c282b3, // add t0, t0, t3
+  0x0002e283, // lwu t0, 0(t0)
+  0x0087d793, // srli a5, a5, 8
+  0x0057c7b3, // xor a5, a5, t0
+  0xfd9ff06f, // j crc32_byte
+  // crc32_done:
+  0xfff7c793, // not a5, a5
+  0x02079793, // slli a5, a5, 32
+  0x0207d793, // srli a5, a5, 32
+  0xe69ff06f, // j done
+};
+
+static const uint32_t* crc32_table()
+{
+  static uint32_t table[256];
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c >> 1) ^ (c & 1 ? 0xedb88320 : 0);
+      table[i] = c;
+    }
+  }
+  return table;
+}
+
+// The monitor expects the CRC32 table right after its code
+#define STUB_IMAGE_BYTES (STUB_CODE + sizeof(stub_code) + 256 * sizeof(uint32_t))
+
+bool target_stub_t::start(addr_t scratch)
+{
+  std::vector<uint8_t> image(STUB_IMAGE_BYTES, 0);
+  memcpy(&image[STUB_CODE], stub_code, sizeof(stub_code));
+  memcpy(&image[STUB_CODE + sizeof(stub_code)], crc32_table(), 256 * sizeof(uint32_t));
+  mem->write(scratch, image.size(), image.data());
+
+  // The bootrom jumps to DRAM_BASE on MSIP, borrow its first two words to
+  // jump on into the monitor
+  int64_t offset = scratch + STUB_CODE - DRAM_BASE;
+  int64_t hi = (offset + 0x800) >> 12;
+  int64_t lo = offset - (hi << 12);
+  if (hi != (int32_t)(hi << 12) >> 12)
+    return false;
+  // The first words are patched and put back, so a read-only shadow of
+  // them stays valid
+  uint32_t saved[2];
+  uint32_t trampoline[2] = { AUIPC(T0, hi), JALR(0, T0, lo) };
+  mem->read(DRAM_BASE, sizeof(saved), saved);
+  mem->patch(DRAM_BASE, sizeof(trampoline), trampoline);
+  mem->write_uint32(CLINT_MSIP_BASE, 1);
+
+  bool ready = false;
+  for (int i = 0; i < STUB_START_POLLS && !ready; i++)
+    ready = mem->read_uint64(scratch + STUB_READY) != 0;
+
+  // Hart 0 has left DRAM_BASE by now, whatever gets loaded there is safe.
+  // If it never checked in, take the MSIP back first so it can't later
+  // boot into the trampoline.
+  if (!ready)
+    mem->write_uint32(CLINT_MSIP_BASE, 0);
+  mem->patch(DRAM_BASE, sizeof(saved), saved);
+  if (ready)
+    base = scratch;
+  return ready;
+}
+
+addr_t target_stub_t::payload_base()
+{
+  return (base + STUB_IMAGE_BYTES + 63) & ~(addr_t)63;
+}
+
+bool target_stub_t::call(uint64_t cmd, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t* result)
+{
+  if (!running())
+    return false;
+  uint64_t args[3] = { arg0, arg1, arg2 };
+  mem->write(base + STUB_ARG0, sizeof(args), args);
+  mem->write_uint64(base + STUB_CMD, cmd);
+  for (int i = 0; i < STUB_CALL_POLLS; i++) {
+    if (mem->read_uint64(base + STUB_CMD) == 0) {
+      *result = mem->read_uint64(base + STUB_RESULT);
+      return true;
+    }
+  }
+  // Don't hand the monitor any more work, it is hung or far too slow
+  detach();
+  return false;
+}
+
+uint32_t crc32_checksum(const uint8_t* src, size_t len)
+{
+  const uint32_t* table = crc32_table();
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < len; i++)
+    crc = (crc >> 8) ^ table[(crc ^ src[i]) & 0xff];
+  return ~crc;
+}
+
+// Greedy single-probe matcher. The decoder copies matches byte by byte, so
+// overlapping matches (long runs of zero padding) are fine and cheap.
+std::vector<uint8_t> lz4_compress(const uint8_t* src, size_t len)
+{
+  const size_t min_match = 4;
+  const size_t max_offset = 65535;
+  std::vector<uint8_t> out;
+  std::vector<int64_t> table(1 << 16, -1);
+  out.reserve(len / 2 + 16);
+
+  auto put_len = [&out](size_t n) {
+    for (; n >= 255; n -= 255)
+      out.push_back(255);
+    out.push_back(n);
+  };
+  auto put_seq = [&](size_t lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t mcode = mlen ? mlen - min_match : 0;
+    out.push_back((std::min<size_t>(nlit, 15) << 4) | std::min<size_t>(mcode, 15));
+    if (nlit >= 15)
+      put_len(nlit - 15);
+    out.insert(out.end(), src + lit, src + lit + nlit);
+    if (!mlen)
+      return;
+    out.push_back(offset & 0xff);
+    out.push_back(offset >> 8);
+    if (mcode >= 15)
+      put_len(mcode - 15);
+  };
+
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + min_match <= len) {
+    uint32_t seq;
+    memcpy(&seq, src + pos, sizeof(seq));
+    uint32_t h = (seq * 2654435761u) >> 16;
+    int64_t cand = table[h];
+    table[h] = pos;
+    if (cand < 0 || pos - cand > max_offset || memcmp(src + cand, src + pos, min_match) != 0) {
+      pos++;
+      continue;
+    }
+    size_t mlen = min_match;
+    while (pos + mlen < len && src[cand + mlen] == src[pos + mlen])
+      mlen++;
+    put_seq(anchor, pos - anchor, pos - cand, mlen);
+    pos += mlen;
+    anchor = pos;
+  }
+  // the last sequence carries literals only, possibly none
+  put_seq(anchor, len - anchor, 0, 0);
+  return out;
+}
@@ -0,0 +1,47 @@
+#ifndef __TARGET_STUB_H
+#define __TARGET_STUB_H
+
+#include <stdint.h>
+#include <vector>
+#include <fesvr/memif.h>
+
+// Commands understood by the target stub monitor
+#define STUB_CMD_LZ4    1 // (src, src_len, dst) -> decompressed bytes
+#define STUB_CMD_MEMSET 2 // (dst, len, -) -> len, zeroes [dst, dst + len)
+#define STUB_CMD_CRC32  3 // (src, len, -) -> CRC32 of [src, src + len)
+
+// A small position-independent RISC-V monitor that hart 0 can be parked in
+// between program load and boot. The host hands it commands through a
+// mailbox in target memory, so memory-bound work runs at core speed instead
+// of link speed. When the host later boots the target with the usual hart 0
+// MSIP, the monitor sends every hart to DRAM_BASE just like the bootrom.
+class target_stub_t
+{
+ public:
+  target_stub_t(memif_t* mem) : mem(mem), base(0) {}
+
+  // Upload the monitor at scratch and divert hart 0 into it. Only valid
+  // before the target has booted. Returns false if hart 0 never checked in.
+  bool start(addr_t scratch);
+  bool running() { return base != 0; }
+  // The monitor hands hart 0 to the program on its next MSIP
+  void detach() { base = 0; }
+  // First free byte past the monitor, for staging command payloads
+  addr_t payload_base();
+
+  // Run a command on the monitor. Returns false, and detaches from the
+  // monitor, if it isn't running or doesn't finish within a bounded number
+  // of polls; the caller then falls back to doing the work over TSI.
+  bool call(uint64_t cmd, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t* result);
+
+ private:
+  memif_t* mem;
+  addr_t base;
+};
+
+// LZ4 block format, as expanded by STUB_CMD_LZ4
+std::vector<uint8_t> lz4_compress(const uint8_t* src, size_t len);
+// Standard (zlib/IEEE 802.3) CRC32, as computed by STUB_CMD_CRC32
+uint32_t crc32_checksum(const uint8_t* src, size_t len);
+
+#endif
@@ -23,10 +23,13 @@ void testchip_htif_t::parse_htif_args(std::vector<std::string> &args) {
 }
 
 void testchip_htif_t::perform_init_accesses() {
+  // init accesses usually target device registers, keep each one separate
+  write_barrier();
   for (auto p : init_accesses) {
     if (p.store) {
       fprintf(stderr, "Writing %lx with %x\n", p.address, p.stdata);
       write_chunk(p.address, sizeof(uint32_t), &p.stdata);
+      write_barrier();
       fprintf(stderr, "Done writing %lx with %x\n", p.address, p.stdata);
     } else {
       fprintf(stderr, "Reading %lx ...", p.address);
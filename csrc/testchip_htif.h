@@ -18,6 +18,8 @@ class testchip_htif_t
  public:
   virtual void write_chunk(addr_t taddr, size_t nbytes, const void* src) = 0;
   virtual void read_chunk(addr_t taddr, size_t nbytes, void* dst) = 0;
+  // keep the next write_chunk from being merged with earlier ones
+  virtual void write_barrier() {};
   virtual ~testchip_htif_t() {};
 
  protected:
@@ -1,12 +1,18 @@
 #include "testchip_tsi.h"
 #include <stdexcept>
+#include <algorithm>
 
-testchip_tsi_t::testchip_tsi_t(int argc, char** argv, bool can_have_loadmem) : tsi_t(argc, argv)
+// Smaller clears aren't worth a round trip through the stub
+#define STUB_MEMSET_MIN_BYTES 4096
+
+testchip_tsi_t::testchip_tsi_t(int argc, char** argv, bool can_have_loadmem) : tsi_t(argc, argv),
+  stub(&memif()), stub_addr(0), load_end(0), stub_memset(false)
 {
   has_loadmem = false;
   init_accesses = std::vector<init_access_t>();
   write_hart0_msip = true;
   is_loadmem = false;
+  in_load = false;
   cflush_addr = 0;
   std::vector<std::string> args(argv + 1, argv + argc);
   for (auto& arg : args) {
@@ -14,6 +20,10 @@ testchip_tsi_t::testchip_tsi_t(int argc, char** argv, bool can_have_loadmem) : t
       has_loadmem = can_have_loadmem;
     if (arg.find("+cflush_addr=0x") == 0)
       cflush_addr = strtoull(arg.substr(15).c_str(), 0, 16);
+    if (arg.find("+stub_addr=0x") == 0)
+      stub_addr = strtoull(arg.substr(13).c_str(), 0, 16);
+    if (arg == "+stub_memset")
+      stub_memset = true;
   }
 
   testchip_htif_t::parse_htif_args(args);
@@ -25,13 +35,25 @@ void testchip_tsi_t::flush_cache_lines(addr_t taddr, size_t nbytes) {
   addr_t base = taddr & ~(cblock_bytes-1);
   while (base < taddr + nbytes) {
     uint32_t data[2] { (uint32_t)base, (uint32_t)(base >> 32) };
+    write_barrier();
     tsi_t::write_chunk(cflush_addr, 8, data);
+    write_barrier();
     base += cblock_bytes;
   }
 }
 
 void testchip_tsi_t::write_chunk(addr_t taddr, size_t nbytes, const void* src)
 {
+  if (in_load) {
+    load_end = std::max(load_end, taddr + nbytes);
+    // A deferred clear must not land on top of data written after it
+    for (auto &it : deferred_clears) {
+      if (taddr < it.first + it.second && it.first < taddr + nbytes) {
+        flush_deferred_clears();
+        break;
+      }
+    }
+  }
   if (is_loadmem) {
     load_mem_write(taddr, nbytes, src);
   } else {
@@ -50,9 +72,96 @@ void testchip_tsi_t::read_chunk(addr_t taddr, size_t nbytes, void* dst)
   }
 }
 
+void testchip_tsi_t::read_chunks(addr_t taddr, size_t nbytes, void* dst)
+{
+  if (is_loadmem) {
+    chunked_memif_t::read_chunks(taddr, nbytes, dst);
+  } else {
+    flush_cache_lines(taddr, nbytes);
+    tsi_t::read_chunks(taddr, nbytes, dst);
+  }
+}
+
+void testchip_tsi_t::transfer_chunks(const std::vector<chunk_op_t>& ops)
+{
+  // Reads from loadmem and cache flushes go access by access through
+  // read_chunk, the rest can be pipelined
+  if (is_loadmem || cflush_addr)
+    chunked_memif_t::transfer_chunks(ops);
+  else
+    tsi_t::transfer_chunks(ops);
+}
+
+void testchip_tsi_t::clear_chunk(addr_t taddr, size_t nbytes)
+{
+  if (!stub_memset || is_loadmem || !write_hart0_msip || nbytes < STUB_MEMSET_MIN_BYTES) {
+    tsi_t::clear_chunk(taddr, nbytes);
+  } else if (in_load) {
+    load_end = std::max(load_end, taddr + nbytes);
+    deferred_clears.push_back(std::make_pair(taddr, nbytes));
+  } else if (stub.running()) {
+    uint64_t cleared;
+    flush_cache_lines(taddr, nbytes);
+    if (!stub.call(STUB_CMD_MEMSET, taddr, nbytes, 0, &cleared))
+      tsi_t::clear_chunk(taddr, nbytes);
+  } else {
+    tsi_t::clear_chunk(taddr, nbytes);
+  }
+}
+
+bool testchip_tsi_t::start_stub()
+{
+  if (stub.running())
+    return true;
+  if (!write_hart0_msip)
+    return false;
+  addr_t scratch = stub_addr ? stub_addr : (load_end + 0xfff) & ~(addr_t)0xfff;
+  return scratch && stub.start(scratch);
+}
+
+void testchip_tsi_t::flush_deferred_clears()
+{
+  std::vector<std::pair<addr_t, size_t>> clears;
+  clears.swap(deferred_clears);
+  if (clears.empty())
+    return;
+
+  // Only start the stub once the image is complete, so nothing lands on it
+  bool was_loading = in_load;
+  in_load = false;
+  bool use_stub = !was_loading && start_stub();
+  for (auto &it : clears) {
+    if (use_stub)
+      clear_chunk(it.first, it.second);
+    else
+      tsi_t::clear_chunk(it.first, it.second);
+  }
+  in_load = was_loading;
+}
+
+void testchip_tsi_t::drop_deferred_clears(addr_t taddr, size_t nbytes)
+{
+  std::vector<std::pair<addr_t, size_t>> kept;
+  addr_t end = taddr + nbytes;
+  for (auto &it : deferred_clears) {
+    addr_t clear_end = it.first + it.second;
+    if (end <= it.first || clear_end <= taddr) {
+      kept.push_back(it);
+      continue;
+    }
+    if (it.first < taddr)
+      kept.push_back(std::make_pair(it.first, taddr - it.first));
+    if (end < clear_end)
+      kept.push_back(std::make_pair(end, clear_end - end));
+  }
+  deferred_clears.swap(kept);
+}
+
 void testchip_tsi_t::reset()
 {
   testchip_htif_t::perform_init_accesses();
-  if (write_hart0_msip)
+  if (write_hart0_msip) {
     tsi_t::reset();
+    stub.detach();
+  }
 }
@@ -6,6 +6,7 @@
 #include <fesvr/tsi.h>
 #include <fesvr/htif.h>
 #include "testchip_htif.h"
+#include "target_stub.h"
 
 class testchip_tsi_t : public tsi_t, public testchip_htif_t
 {
@@ -15,11 +16,13 @@ class testchip_tsi_t : public tsi_t, public testchip_htif_t
 
   void write_chunk(addr_t taddr, size_t nbytes, const void* src) override;
   void read_chunk(addr_t taddr, size_t nbytes, void* dst) override;
+  void read_chunks(addr_t taddr, size_t nbytes, void* dst) override;
+  void clear_chunk(addr_t taddr, size_t nbytes) override;
+  void transfer_chunks(const std::vector<chunk_op_t>& ops) override;
+  void write_barrier() override { tsi_t::write_barrier(); }
   void load_program() {
-    switch_to_target();
-    is_loadmem = has_loadmem;
-    tsi_t::load_program();
-    is_loadmem = false;
+    load_image();
+    flush_deferred_clears();
   }
   void idle() { switch_to_target(); }
 
@@ -28,11 +31,36 @@ class testchip_tsi_t : public tsi_t, public testchip_htif_t
   virtual void load_mem_read(addr_t taddr, size_t nbytes, void* dst) { };
   void flush_cache_lines(addr_t taddr, size_t nbytes);
   void reset() override;
+  void load_image() {
+    switch_to_target();
+    is_loadmem = has_loadmem;
+    in_load = true;
+    tsi_t::load_program();
+    in_load = false;
+    is_loadmem = false;
+  }
+  void flush_deferred_clears();
+  // Forget the part of any deferred clear that [taddr, taddr + nbytes)
+  // covers, for data that will be written later anyway
+  void drop_deferred_clears(addr_t taddr, size_t nbytes);
   bool has_loadmem;
 
+  // Helper routines on the target, usable before boot. Placed at stub_addr
+  // (+stub_addr=0x...), or past the end of the loaded program if that is 0.
+  target_stub_t stub;
+  addr_t stub_addr;
+  addr_t load_end;
+  bool start_stub();
+  // Zero large clears during load through the stub instead of over the
+  // link. Off unless +stub_memset is given or a subclass turns it on.
+  bool stub_memset;
+
  private:
 
   bool is_loadmem;
+  bool in_load;
   addr_t cflush_addr;
+  // Large clears seen during load, zeroed by the stub once the image is in
+  std::vector<std::pair<addr_t, size_t>> deferred_clears;
 };
 #endif
@@ -2,12 +2,125 @@
 #include <assert.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 static __thread context_t* cur;
 
+#ifdef USE_FAST_CONTEXT
+// context_switch saves the callee-saved registers on the current stack,
+// stores the stack pointer to *save and resumes the stack at sp by restoring
+// the registers saved there. A new context's stack is laid out as if it had
+// switched out just before context_start, which calls the function in the
+// second saved register with the first as its argument.
+extern "C" void context_switch(void** save, void* sp);
+
+#if defined(__x86_64__)
+// rbx, rbp, r12-r15, and the SSE and x87 control words, which the ABI also
+// asks callees to preserve
+#define CONTEXT_FRAME_WORDS 8
+#define CONTEXT_FRAME_ARG 4 // r12
+#define CONTEXT_FRAME_FUNC 3 // r13
+#define CONTEXT_FRAME_START 7 // return address
+asm(
+  ".text\n"
+  ".globl context_switch\n"
+  ".hidden context_switch\n"
+  ".type context_switch, @function\n"
+  "context_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size context_switch, .-context_switch\n"
+  ".type context_start, @function\n"
+  "context_start:\n"
+  "  .cfi_startproc\n"
+  "  .cfi_undefined rip\n"
+  "  movq %r12, %rdi\n"
+  "  call *%r13\n"
+  "  ud2\n"
+  "  .cfi_endproc\n"
+  ".size context_start, .-context_start\n"
+);
+#elif defined(__aarch64__)
+// x19-x30 and d8-d15
+#define CONTEXT_FRAME_WORDS 20
+#define CONTEXT_FRAME_ARG 0 // x19
+#define CONTEXT_FRAME_FUNC 1 // x20
+#define CONTEXT_FRAME_START 11 // x30
+asm(
+  ".text\n"
+  ".globl context_switch\n"
+  ".hidden context_switch\n"
+  ".type context_switch, %function\n"
+  "context_switch:\n"
+  "  sub sp, sp, #160\n"
+  "  stp x19, x20, [sp, #0]\n"
+  "  stp x21, x22, [sp, #16]\n"
+  "  stp x23, x24, [sp, #32]\n"
+  "  stp x25, x26, [sp, #48]\n"
+  "  stp x27, x28, [sp, #64]\n"
+  "  stp x29, x30, [sp, #80]\n"
+  "  stp d8, d9, [sp, #96]\n"
+  "  stp d10, d11, [sp, #112]\n"
+  "  stp d12, d13, [sp, #128]\n"
+  "  stp d14, d15, [sp, #144]\n"
+  "  mov x2, sp\n"
+  "  str x2, [x0]\n"
+  "  mov sp, x1\n"
+  "  ldp x19, x20, [sp, #0]\n"
+  "  ldp x21, x22, [sp, #16]\n"
+  "  ldp x23, x24, [sp, #32]\n"
+  "  ldp x25, x26, [sp, #48]\n"
+  "  ldp x27, x28, [sp, #64]\n"
+  "  ldp x29, x30, [sp, #80]\n"
+  "  ldp d8, d9, [sp, #96]\n"
+  "  ldp d10, d11, [sp, #112]\n"
+  "  ldp d12, d13, [sp, #128]\n"
+  "  ldp d14, d15, [sp, #144]\n"
+  "  add sp, sp, #160\n"
+  "  ret\n"
+  ".size context_switch, .-context_switch\n"
+  ".type context_start, %function\n"
+  "context_start:\n"
+  "  .cfi_startproc\n"
+  "  .cfi_undefined x30\n"
+  "  mov x0, x19\n"
+  "  blr x20\n"
+  "  brk #0\n"
+  "  .cfi_endproc\n"
+  ".size context_start, .-context_start\n"
+);
+#endif
+
+extern "C" void context_start();
+#endif
+
 context_t::context_t()
-  : creator(NULL), func(NULL), arg(NULL),
-#ifndef USE_UCONTEXT
+  : creator(NULL), func(NULL), arg(NULL), stack(NULL), stack_bytes(0),
+#if defined(USE_FAST_CONTEXT)
+    sp(NULL)
+#elif !defined(USE_UCONTEXT)
     mutex(PTHREAD_MUTEX_INITIALIZER),
     cond(PTHREAD_COND_INITIALIZER), flag(0)
 #else
@@ -16,7 +129,16 @@ context_t::context_t()
 {
 }
 
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+void context_t::wrapper(context_t* ctx)
+{
+  ctx->creator->switch_to();
+  ctx->func(ctx->arg);
+  // like uc_link, continue in the creator once func returns
+  ctx->creator->switch_to();
+  abort();
+}
+#elif defined(USE_UCONTEXT)
 #ifndef GLIBC_64BIT_PTR_BUG
 void context_t::wrapper(context_t* ctx)
 {
@@ -40,17 +162,51 @@ void* context_t::wrapper(void* a)
 }
 #endif
 
-void context_t::init(void (*f)(void*), void* a)
+// Maps the stack with a PROT_NONE page below it, so that an overflow faults
+// instead of running into whatever memory lies there
+void context_t::alloc_stack(size_t size)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size = (size + page - 1) / page * page;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+  flags |= MAP_STACK;
+#endif
+  stack = mmap(NULL, size + page, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (stack == MAP_FAILED || mprotect(stack, page, PROT_NONE) != 0)
+    abort();
+  stack_bytes = size + page;
+}
+
+void context_t::init(void (*f)(void*), void* a, size_t stack_size)
 {
   func = f;
   arg = a;
   creator = current();
+  if (stack_size == 0)
+    stack_size = CONTEXT_STACK_SIZE;
 
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+  alloc_stack(stack_size);
+  uintptr_t top = ((uintptr_t)stack + stack_bytes) & ~(uintptr_t)15;
+  uintptr_t* frame = (uintptr_t*)top - CONTEXT_FRAME_WORDS;
+  for (int i = 0; i < CONTEXT_FRAME_WORDS; i++)
+    frame[i] = 0;
+#if defined(__x86_64__)
+  frame[0] = 0x1f80 | ((uintptr_t)0x37f << 32); // power-on MXCSR and FPU CW
+#endif
+  frame[CONTEXT_FRAME_ARG] = (uintptr_t)this;
+  frame[CONTEXT_FRAME_FUNC] = (uintptr_t)&context_t::wrapper;
+  frame[CONTEXT_FRAME_START] = (uintptr_t)&context_start;
+  sp = frame;
+  switch_to();
+#elif defined(USE_UCONTEXT)
   getcontext(context.get());
   context->uc_link = creator->context.get();
-  context->uc_stack.ss_size = 64*1024;
-  context->uc_stack.ss_sp = new void*[context->uc_stack.ss_size/sizeof(void*)];
+  alloc_stack(stack_size);
+  size_t guard = sysconf(_SC_PAGESIZE);
+  context->uc_stack.ss_size = stack_bytes - guard;
+  context->uc_stack.ss_sp = (char*)stack + guard;
 #ifndef GLIBC_64BIT_PTR_BUG
   makecontext(context.get(), (void(*)(void))&context_t::wrapper, 1, this);
 #else
@@ -64,8 +220,12 @@ void context_t::init(void (*f)(void*), void* a)
 
   pthread_mutex_lock(&creator->mutex);
   creator->flag = 0;
-  if (pthread_create(&thread, NULL, &context_t::wrapper, this) != 0)
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stack_size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stack_size);
+  if (pthread_create(&thread, &attr, &context_t::wrapper, this) != 0)
     abort();
+  pthread_attr_destroy(&attr);
   pthread_detach(thread);
   while (!creator->flag)
     pthread_cond_wait(&creator->cond, &creator->mutex);
@@ -76,12 +236,19 @@ void context_t::init(void (*f)(void*), void* a)
 context_t::~context_t()
 {
   assert(this != cur);
+  // the stack init() allocated, so contexts can come and go within a process
+  if (stack)
+    munmap(stack, stack_bytes);
 }
 
 void context_t::switch_to()
 {
   assert(this != cur);
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+  context_t* prev = cur;
+  cur = this;
+  context_switch(&prev->sp, sp);
+#elif defined(USE_UCONTEXT)
   context_t* prev = cur;
   cur = this;
   if (swapcontext(prev->context.get(), context.get()) != 0)
@@ -104,7 +271,9 @@ context_t* context_t::current()
   if (cur == NULL)
   {
     cur = new context_t;
-#ifdef USE_UCONTEXT
+#if defined(USE_FAST_CONTEXT)
+    // sp is saved by the first switch away
+#elif defined(USE_UCONTEXT)
     getcontext(cur->context.get());
 #else
     cur->thread = pthread_self();
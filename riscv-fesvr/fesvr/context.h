@@ -4,8 +4,25 @@
 // A replacement for ucontext.h, which is sadly deprecated.
 
 #include <pthread.h>
+#include <stddef.h>
 
-#if defined(__GLIBC__)
+// Stack size of contexts that init() is not given one for. Stacks are mapped
+// lazily, so only the pages a context touches cost memory.
+#ifndef CONTEXT_STACK_SIZE
+#define CONTEXT_STACK_SIZE (256*1024)
+#endif
+
+// On x86-64 and aarch64 ELF targets contexts switch with a few instructions
+// that save and restore the callee-saved registers. ucontext is the fallback,
+// and threads the fallback to that. The fast switch returns into another
+// stack behind the back of a CET shadow stack, so builds that enable one
+// (-fcf-protection=return or full, -mshstk) use glibc's ucontext, which
+// switches shadow stacks too.
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__) && !defined(CONTEXT_NO_FAST_SWITCH) && \
+  !(defined(__CET__) && (__CET__ & 2)) && !defined(__SHSTK__)
+# undef USE_FAST_CONTEXT
+# define USE_FAST_CONTEXT
+#elif defined(__GLIBC__)
 # undef USE_UCONTEXT
 # define USE_UCONTEXT
 # include <ucontext.h>
@@ -28,14 +45,22 @@ class context_t
  public:
   context_t();
   ~context_t();
-  void init(void (*func)(void*), void* arg);
+  // Starts a context running func(arg) on its own stack of stack_size bytes,
+  // or CONTEXT_STACK_SIZE when 0, below which sits a guard page
+  void init(void (*func)(void*), void* arg, size_t stack_size = 0);
   void switch_to();
   static context_t* current();
  private:
   context_t* creator;
   void (*func)(void*);
   void* arg;
-#ifdef USE_UCONTEXT
+  void* stack; // mapping holding the guard page and the stack
+  size_t stack_bytes;
+  void alloc_stack(size_t size);
+#if defined(USE_FAST_CONTEXT)
+  void* sp; // saved while the context is switched out
+  static void wrapper(context_t*);
+#elif defined(USE_UCONTEXT)
   std::unique_ptr<ucontext_t> context;
 #ifndef GLIBC_64BIT_PTR_BUG
   static void wrapper(context_t*);
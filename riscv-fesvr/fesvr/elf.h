@@ -14,6 +14,8 @@
 
 #define PT_LOAD 1
 
+#define PF_W 2
+
 #define SHT_NOBITS 8
 
 typedef struct {
@@ -13,23 +13,31 @@
 #include <stdio.h>
 #include <vector>
 #include <map>
+#include <stdexcept>
 
 std::map<std::string, uint64_t> load_elf(const char* fn, memif_t* memif, reg_t* entry)
 {
+  // Thrown rather than asserted, so a host that runs many programs (e.g.
+  // uart_tsi's daemon) only fails the one with the bad file
   int fd = open(fn, O_RDONLY);
   struct stat s;
-  assert(fd != -1);
-  if (fstat(fd, &s) < 0)
-    abort();
+  if (fd == -1)
+    throw std::invalid_argument(std::string("Specified ELF can't be opened: ") + fn);
+  if (fstat(fd, &s) < 0) {
+    close(fd);
+    throw std::invalid_argument(std::string("Specified ELF can't be read: ") + fn);
+  }
   size_t size = s.st_size;
 
-  char* buf = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-  assert(buf != MAP_FAILED);
+  char* buf = size >= sizeof(Elf64_Ehdr) ?
+    (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : (char*)MAP_FAILED;
   close(fd);
-
-  assert(size >= sizeof(Elf64_Ehdr));
   const Elf64_Ehdr* eh64 = (const Elf64_Ehdr*)buf;
-  assert(IS_ELF32(*eh64) || IS_ELF64(*eh64));
+  if (buf == MAP_FAILED || !(IS_ELF32(*eh64) || IS_ELF64(*eh64))) {
+    if (buf != MAP_FAILED)
+      munmap(buf, size);
+    throw std::invalid_argument(std::string("Specified file is not an ELF: ") + fn);
+  }
 
   std::vector<uint8_t> zeros;
   std::map<std::string, uint64_t> symbols;
@@ -44,6 +52,8 @@ std::map<std::string, uint64_t> load_elf(const char* fn, memif_t* memif, reg_t*
         if (ph[i].p_filesz) { \
           assert(size >= ph[i].p_offset + ph[i].p_filesz); \
           memif->write(ph[i].p_paddr, ph[i].p_filesz, (uint8_t*)buf + ph[i].p_offset); \
+          if (!(ph[i].p_flags & PF_W)) \
+            memif->shadow(ph[i].p_paddr, ph[i].p_filesz, (uint8_t*)buf + ph[i].p_offset); \
         } \
         zeros.resize(ph[i].p_memsz - ph[i].p_filesz); \
         memif->write(ph[i].p_paddr + ph[i].p_filesz, ph[i].p_memsz - ph[i].p_filesz, &zeros[0]); \
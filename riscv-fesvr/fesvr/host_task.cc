@@ -0,0 +1,86 @@
+#include "host_task.h"
+#include <assert.h>
+
+static __thread host_task_t* running;
+
+host_task_t::host_task_t()
+  : driver(NULL), started(false), finished(false)
+{
+}
+
+void host_task_t::thread(void* arg)
+{
+  host_task_t* task = static_cast<host_task_t*>(arg);
+  // an exception can't unwind past this context's stack, so hand it to
+  // the driver
+  try {
+    task->body();
+  } catch (...) {
+    task->error = std::current_exception();
+  }
+  task->finished = true;
+
+  while (true)
+    task->driver->switch_to();
+}
+
+void host_task_t::start(std::function<void()> f, size_t stack_size)
+{
+  assert(!started);
+  body = f;
+  context.init(thread, this, stack_size);
+  started = true;
+}
+
+bool host_task_t::poll()
+{
+  if (!runnable())
+    return false;
+
+  // tasks may drive tasks of their own
+  host_task_t* prev = running;
+  running = this;
+  driver = context_t::current();
+  context.switch_to();
+  running = prev;
+
+  if (error) {
+    std::exception_ptr e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+  return true;
+}
+
+void host_task_t::await(std::function<bool()> r)
+{
+  host_task_t* task = running;
+  assert(task);
+  if (r && r())
+    return;
+
+  task->ready = r;
+  task->driver->switch_to();
+  task->ready = nullptr;
+}
+
+host_task_t* host_task_t::current()
+{
+  return running;
+}
+
+size_t host_scheduler_t::poll()
+{
+  size_t ran = 0;
+  for (auto task : tasks)
+    ran += task->poll();
+  return ran;
+}
+
+bool host_scheduler_t::done()
+{
+  for (auto task : tasks)
+    if (!task->done())
+      return false;
+  return true;
+}
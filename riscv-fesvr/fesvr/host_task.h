@@ -0,0 +1,69 @@
+#ifndef _HTIF_HOST_TASK_H
+#define _HTIF_HOST_TASK_H
+
+#include "context.h"
+#include <exception>
+#include <functional>
+#include <vector>
+
+// A host program, e.g. htif_t::run(), run as a task on its own context and
+// driven by whoever moves its transport's data. Inside the task, await()
+// suspends it until a condition holds, the way co_await suspends a C++20
+// coroutine, except that the task has its own stack and so may suspend at
+// any depth, such as inside a memif_t read issued from load_elf(). The
+// driver calls poll() as often as it likes, every cycle or every poll of a
+// link, and the task is only switched in once what it awaits is ready.
+//
+// tsi_t and BlockDevice run their hosts this way behind their usual
+// htif_t, chunked_memif_t and tick() interfaces. host_scheduler_t runs
+// any number of such hosts, e.g. one per chip, on one thread.
+class host_task_t
+{
+ public:
+  host_task_t();
+  // Sets up body to run on the task's context, with a stack of stack_size
+  // bytes as for context_t::init(). It starts on the first poll().
+  void start(std::function<void()> body, size_t stack_size = 0);
+  // Resumes the task until it next suspends if it is runnable, and returns
+  // whether it was. An exception that escaped the body is rethrown here.
+  bool poll();
+  bool runnable() { return started && !finished && (!ready || ready()); }
+  bool done() { return finished; }
+
+  // Suspends the task running on this thread until ready() holds. ready()
+  // is only evaluated by poll(), outside the task.
+  static void await(std::function<bool()> ready);
+  // Suspends it until the next poll(), for a host with nothing particular
+  // to wait for, e.g. in idle()
+  static void yield() { await(nullptr); }
+  // The task running on this thread, NULL outside of any
+  static host_task_t* current();
+
+ private:
+  context_t context;
+  context_t* driver; // who called poll(), and is switched back to
+  std::function<void()> body;
+  std::function<bool()> ready; // what the task awaits, empty for anything
+  std::exception_ptr error; // escaped from the body, for poll() to throw
+  bool started;
+  bool finished;
+
+  static void thread(void* arg);
+};
+
+// Hosts sharing the calling thread, each resumed once what it awaits is
+// ready. Tasks are not owned.
+class host_scheduler_t
+{
+ public:
+  void add(host_task_t* task) { tasks.push_back(task); }
+  // Polls every task once, returns how many ran
+  size_t poll();
+  // whether every task has finished
+  bool done();
+
+ private:
+  std::vector<host_task_t*> tasks;
+};
+
+#endif
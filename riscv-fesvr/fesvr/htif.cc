@@ -5,6 +5,7 @@
 #include "elfloader.h"
 #include "encoding.h"
 #include <algorithm>
+#include <chrono>
 #include <assert.h>
 #include <vector>
 #include <queue>
@@ -30,6 +31,15 @@
 # define TARGET_DIR "/" TARGET_ARCH "/bin/"
 #endif
 
+// +poll=backoff starts at the minimum after every syscall and doubles while
+// polls keep coming back empty
+#define HTIF_POLL_BACKOFF_MIN_US 10
+#define HTIF_POLL_BACKOFF_MAX_US 10000
+
+// tohost and fromhost are polled with a single read when they sit in the
+// same aligned block of this many bytes
+#define HTIF_POLL_BLOCK_BYTES 64
+
 static volatile bool signal_exit = false;
 static void handle_signal(int sig)
 {
@@ -42,7 +52,8 @@ static void handle_signal(int sig)
 htif_t::htif_t()
   : mem(this), entry(DRAM_BASE), sig_addr(0), sig_len(0),
     tohost_addr(0), fromhost_addr(0), exitcode(0), stopped(false),
-    syscall_proxy(this)
+    poll_policy(POLL_SPIN), poll_interval(0), polls(0), poll_hits(0),
+    command_time(0), syscall_proxy(this)
 {
   signal(SIGINT, &handle_signal);
   signal(SIGTERM, &handle_signal);
@@ -111,6 +122,11 @@ void htif_t::load_program()
         memif_t::write(taddr, len, src);
     }
 
+    void shadow(addr_t taddr, size_t len, const void* src) override
+    {
+      htif->mem.shadow(taddr, len, src);
+    }
+
    private:
     htif_t* htif;
   } preload_aware_memif(this);
@@ -160,11 +176,12 @@ void htif_t::stop()
 
 void htif_t::clear_chunk(addr_t taddr, size_t len)
 {
-  char zeros[chunk_max_size()];
-  memset(zeros, 0, chunk_max_size());
+  // not on the stack: hosts often run on a small coroutine stack and
+  // chunk sizes can be configured large
+  std::vector<char> zeros(chunk_max_size(), 0);
 
   for (size_t pos = 0; pos < len; pos += chunk_max_size())
-    write_chunk(taddr + pos, std::min(len - pos, chunk_max_size()), zeros);
+    write_chunk(taddr + pos, std::min(len - pos, chunk_max_size()), zeros.data());
 }
 
 int htif_t::run()
@@ -181,19 +198,81 @@ int htif_t::run()
       idle();
   }
 
+  // On link-latency-bound transports every access is a round trip, so when
+  // tohost and fromhost share a block, read both at once. Only when fromhost
+  // directly follows tohost can they also be written at once, without
+  // clobbering anything and with tohost cleared ahead of the reply.
+  //
+  // Writing them together means tohost is only cleared once handle_command
+  // has returned. That relies on the target side of HTIF only ever waiting
+  // for tohost to read 0 before it writes the next command, and on no
+  // device waiting, within handle_command, for the target to act on tohost
+  // being cleared. Both hold for the devices in fesvr: the target is only
+  // held up for the length of the command.
+  addr_t poll_base = std::min(tohost_addr, fromhost_addr);
+  size_t poll_len = std::max(tohost_addr, fromhost_addr) + sizeof(uint64_t) - poll_base;
+  bool poll_combined = fromhost_addr &&
+    poll_base / HTIF_POLL_BLOCK_BYTES == (poll_base + poll_len - 1) / HTIF_POLL_BLOCK_BYTES &&
+    poll_len <= chunk_max_size();
+  bool write_combined = poll_combined && tohost_addr + sizeof(uint64_t) == fromhost_addr;
+  uint64_t poll_buf[HTIF_POLL_BLOCK_BYTES / sizeof(uint64_t)];
+  uint64_t* tohost_word = &poll_buf[(tohost_addr - poll_base) / sizeof(uint64_t)];
+  uint64_t* fromhost_word = &poll_buf[(fromhost_addr - poll_base) / sizeof(uint64_t)];
+
   while (!signal_exit && exitcode == 0)
   {
-    if (auto tohost = mem.read_uint64(tohost_addr)) {
-      mem.write_uint64(tohost_addr, 0);
+    // fromhost as of the poll, valid while fromhost_fresh. Only the host sets
+    // it, so a 0 stays 0 until the host writes it.
+    uint64_t fromhost = 0;
+    bool fromhost_fresh = false;
+    uint64_t tohost;
+    if (poll_combined) {
+      mem.read(poll_base, poll_len, poll_buf);
+      tohost = *tohost_word;
+      fromhost = *fromhost_word;
+      fromhost_fresh = true;
+    } else {
+      tohost = mem.read_uint64(tohost_addr);
+    }
+
+    polls++;
+
+    if (tohost) {
+      poll_hits++;
+      auto start = std::chrono::steady_clock::now();
+      if (!write_combined)
+        mem.write_uint64(tohost_addr, 0);
       command_t cmd(mem, tohost, fromhost_callback);
       device_list.handle_command(cmd);
+      command_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (write_combined) {
+        // clear tohost and deliver the reply in one write
+        *tohost_word = 0;
+        bool deliver = !fromhost_queue.empty() && fromhost == 0;
+        if (deliver) {
+          *fromhost_word = fromhost_queue.front();
+          fromhost_queue.pop();
+        }
+        if (deliver)
+          mem.write(poll_base, poll_len, poll_buf);
+        else
+          mem.write_uint64(tohost_addr, 0);
+        fromhost_fresh = !deliver;
+      }
+      // syscalls tend to come in bursts, be quick to see the next one
+      if (poll_policy == POLL_BACKOFF)
+        poll_interval = 0;
     } else {
       idle();
+      poll_idle();
     }
 
     device_list.tick();
 
-    if (!fromhost_queue.empty() && mem.read_uint64(fromhost_addr) == 0) {
+    // a busy fromhost may have been taken by the target since the poll
+    if (!fromhost_queue.empty() && (!fromhost_fresh || fromhost != 0))
+      fromhost = mem.read_uint64(fromhost_addr);
+    if (!fromhost_queue.empty() && fromhost == 0) {
       mem.write_uint64(fromhost_addr, fromhost_queue.front());
       fromhost_queue.pop();
     }
@@ -204,6 +283,35 @@ int htif_t::run()
   return exit_code();
 }
 
+void htif_t::poll_idle()
+{
+  if (poll_policy == POLL_BACKOFF)
+    poll_interval = std::min<uint64_t>(HTIF_POLL_BACKOFF_MAX_US,
+                                       std::max<uint64_t>(HTIF_POLL_BACKOFF_MIN_US, poll_interval * 2));
+  if (poll_policy != POLL_SPIN)
+    poll_wait(poll_interval);
+}
+
+void htif_t::poll_wait(uint64_t us)
+{
+  usleep(us);
+}
+
+void htif_t::set_poll_policy(const std::string& policy)
+{
+  if (policy == "spin") {
+    poll_policy = POLL_SPIN;
+  } else if (policy == "backoff") {
+    poll_policy = POLL_BACKOFF;
+    poll_interval = 0;
+  } else if (policy.find("interval:") == 0 && policy.size() > 9) {
+    poll_policy = POLL_INTERVAL;
+    poll_interval = strtoull(policy.c_str() + 9, NULL, 0);
+  } else {
+    throw std::invalid_argument("Unknown poll policy " + policy + " (expected spin, backoff or interval:<us>)");
+  }
+}
+
 bool htif_t::done()
 {
   return stopped;
@@ -214,6 +322,11 @@ int htif_t::exit_code()
   return exitcode >> 1;
 }
 
+bool htif_t::interrupted()
+{
+  return signal_exit;
+}
+
 void htif_t::parse_arguments(int argc, char ** argv)
 {
   optind = 0; // reset optind as HTIF may run getopt _after_ others
@@ -242,6 +355,12 @@ void htif_t::parse_arguments(int argc, char ** argv)
       case HTIF_LONG_OPTIONS_OPTIND + 3:
         syscall_proxy.set_chroot(optarg);
         break;
+      case HTIF_LONG_OPTIONS_OPTIND + 4:
+        set_poll_policy(optarg);
+        break;
+      case HTIF_LONG_OPTIONS_OPTIND + 5:
+        mem.set_shadowing(true);
+        break;
       case '?':
         if (!opterr)
           break;
@@ -268,6 +387,14 @@ void htif_t::parse_arguments(int argc, char ** argv)
           c = HTIF_LONG_OPTIONS_OPTIND + 3;
           optarg = optarg + 8;
         }
+        else if (arg.find("+poll=") == 0) {
+          c = HTIF_LONG_OPTIONS_OPTIND + 4;
+          optarg = optarg + 6;
+        }
+        else if (arg == "+shadow") {
+          c = HTIF_LONG_OPTIONS_OPTIND + 5;
+          optarg = nullptr;
+        }
         else if (arg.find("+permissive-off") == 0) {
           if (opterr)
             throw std::invalid_argument("Found +permissive-off when not parsing permissively");
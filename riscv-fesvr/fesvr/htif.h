@@ -23,9 +23,17 @@ class htif_t : public chunked_memif_t
   int run();
   bool done();
   int exit_code();
+  // run() returned because of SIGINT/SIGTERM, not because the target exited
+  bool interrupted();
 
   virtual memif_t& memif() { return mem; }
 
+  // for hosts that report on how their link is used
+  uint64_t poll_count() { return polls; }
+  uint64_t poll_hit_count() { return poll_hits; }
+  double command_seconds() { return command_time; }
+  const std::map<reg_t, syscall_t::stats_t>& syscall_stats() { return syscall_proxy.get_stats(); }
+
  protected:
   virtual void reset() = 0;
 
@@ -38,6 +46,10 @@ class htif_t : public chunked_memif_t
 
   virtual void load_program();
   virtual void idle() {}
+  // Called by run() to pause between polls of tohost under +poll=backoff or
+  // +poll=interval. Sleeps by default; hosts whose target only advances
+  // while the host runs (e.g. simulators) should override it.
+  virtual void poll_wait(uint64_t us);
 
   const std::vector<std::string>& host_args() { return hargs; }
 
@@ -65,6 +77,17 @@ class htif_t : public chunked_memif_t
   int exitcode;
   bool stopped;
 
+  // How run() paces its polls of tohost, set with +poll=
+  enum poll_policy_t { POLL_SPIN, POLL_BACKOFF, POLL_INTERVAL };
+  poll_policy_t poll_policy;
+  uint64_t poll_interval; // in us, fixed for POLL_INTERVAL, grows for POLL_BACKOFF
+  void set_poll_policy(const std::string& policy);
+  void poll_idle();
+
+  uint64_t polls; // reads of tohost by run()
+  uint64_t poll_hits; // those that found a command
+  double command_time; // seconds spent handling commands
+
   device_list_t device_list;
   syscall_t syscall_proxy;
   bcd_t bcd;
@@ -93,6 +116,12 @@ class htif_t : public chunked_memif_t
        +signature=FILE\n\
       --chroot=PATH        Use PATH as location of syscall-servicing binaries\n\
        +chroot=PATH\n\
+      --poll=POLICY        How often to poll the target for syscalls: spin\n\
+       +poll=POLICY          (default, as fast as possible), backoff (back\n\
+                             off while idle, fast again after a syscall) or\n\
+                             interval:US (every US microseconds)\n\
+      --shadow             Serve host reads of read-only ELF segments from a\n\
+       +shadow               host copy instead of the target\n\
 \n\
 HOST OPTIONS (currently unsupported)\n\
       --disk=DISK          Add DISK device. Use a ramdisk since this isn't\n\
@@ -109,6 +138,8 @@ TARGET (RISC-V BINARY) OPTIONS\n\
 {"disk",      required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 1 },     \
 {"signature", required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 2 },     \
 {"chroot",    required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 3 },     \
+{"poll",      required_argument, 0, HTIF_LONG_OPTIONS_OPTIND + 4 },     \
+{"shadow",    no_argument,       0, HTIF_LONG_OPTIONS_OPTIND + 5 },     \
 {0, 0, 0, 0}
 
 #endif // __HTIF_H
@@ -4,10 +4,155 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdexcept>
+#include <iterator>
 #include "memif.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Writes are scanned for zero runs in blocks of this many bytes
+#define MEMIF_ZERO_BLOCK 64
+
+void chunked_memif_t::read_chunks(addr_t taddr, size_t len, void* dst)
+{
+  for (size_t pos = 0; pos < len; pos += chunk_max_size())
+    read_chunk(taddr + pos, std::min(chunk_max_size(), len - pos), (char*)dst + pos);
+}
+
+void chunked_memif_t::transfer_chunks(const std::vector<chunk_op_t>& ops)
+{
+  for (auto& op : ops) {
+    if (op.write)
+      write_chunk(op.addr, op.len, op.bytes);
+    else
+      read_chunk(op.addr, op.len, op.bytes);
+  }
+}
+
+void memif_batch_t::read(addr_t addr, size_t len, void* bytes)
+{
+  ops.push_back(memif_op_t{false, addr, len, bytes, std::vector<uint8_t>()});
+}
+
+void memif_batch_t::write(addr_t addr, size_t len, const void* bytes)
+{
+  ops.push_back(memif_op_t{true, addr, len, NULL,
+                           std::vector<uint8_t>((const uint8_t*)bytes, (const uint8_t*)bytes + len)});
+}
+
+void memif_batch_t::submit()
+{
+  if (!ops.empty())
+    memif->submit(ops);
+  ops.clear();
+}
+
+void memif_t::add_chunks(std::vector<chunk_op_t>& chunks, bool write, addr_t addr, size_t len, uint8_t* bytes)
+{
+  size_t max_chunk = cmemif->chunk_max_size();
+  for (size_t pos = 0; pos < len; pos += max_chunk)
+    chunks.push_back(chunk_op_t{write, addr + pos, std::min(max_chunk, len - pos), bytes + pos});
+}
+
+void memif_t::submit(std::vector<memif_op_t>& ops)
+{
+  size_t align = cmemif->chunk_align();
+  std::vector<chunk_op_t> chunks;
+  // Unaligned reads fetch the aligned words around them into a bounce
+  // buffer, and are copied out once the transfer is done
+  std::vector<std::vector<uint8_t>> bounce(ops.size());
+  std::vector<size_t> bounced; // indices into ops
+  auto transfer = [&]() {
+    if (!chunks.empty())
+      cmemif->transfer_chunks(chunks);
+    chunks.clear();
+    for (size_t i : bounced)
+      memcpy(ops[i].dst, &bounce[i][ops[i].addr & (align-1)], ops[i].len);
+    bounced.clear();
+  };
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    memif_op_t& op = ops[i];
+    if (!op.len)
+      continue;
+    if (op.write) {
+      if (((op.addr | op.len) & (align-1)) || op.len >= zero_run_min) {
+        // the read-modify-write of unaligned ends must see what came before
+        transfer();
+        write(op.addr, op.len, op.data.data());
+        continue;
+      }
+      if (!shadows.empty())
+        drop_shadows(op.addr, op.len);
+      nwritten += op.len;
+      add_chunks(chunks, true, op.addr, op.len, op.data.data());
+    } else {
+      if (!shadows.empty() && read_shadow(op.addr, op.len, op.dst))
+        continue;
+      nread += op.len;
+      if ((op.addr | op.len) & (align-1)) {
+        addr_t start = op.addr & ~(addr_t)(align-1);
+        addr_t end = (op.addr + op.len + align - 1) & ~(addr_t)(align-1);
+        bounce[i].resize(end - start);
+        add_chunks(chunks, false, start, end - start, bounce[i].data());
+        bounced.push_back(i);
+      } else {
+        add_chunks(chunks, false, op.addr, op.len, (uint8_t*)op.dst);
+      }
+    }
+  }
+  transfer();
+}
+
+void memif_t::set_shadowing(bool enable)
+{
+  shadowing = enable;
+  shadows.clear();
+}
+
+void memif_t::shadow(addr_t addr, size_t len, const void* bytes)
+{
+  if (!shadowing || !len)
+    return;
+  drop_shadows(addr, len);
+  shadows[addr].assign((const uint8_t*)bytes, (const uint8_t*)bytes + len);
+}
+
+void memif_t::patch(addr_t addr, size_t len, const void* bytes)
+{
+  std::map<addr_t, std::vector<uint8_t>> kept;
+  kept.swap(shadows);
+  write(addr, len, bytes);
+  shadows.swap(kept);
+}
+
+bool memif_t::read_shadow(addr_t addr, size_t len, void* bytes)
+{
+  auto it = shadows.upper_bound(addr);
+  if (it == shadows.begin())
+    return false;
+  --it;
+  if (addr + len > it->first + it->second.size())
+    return false;
+  memcpy(bytes, &it->second[addr - it->first], len);
+  return true;
+}
+
+void memif_t::drop_shadows(addr_t addr, size_t len)
+{
+  auto it = shadows.upper_bound(addr);
+  if (it != shadows.begin() && std::prev(it)->first + std::prev(it)->second.size() > addr)
+    --it;
+  while (it != shadows.end() && it->first < addr + len)
+    it = shadows.erase(it);
+}
 
 void memif_t::read(addr_t addr, size_t len, void* bytes)
 {
+  if (!shadows.empty() && read_shadow(addr, len, bytes))
+    return;
+  nread += len;
+
   size_t align = cmemif->chunk_align();
   if (len && (addr & (align-1)))
   {
@@ -35,12 +180,16 @@ void memif_t::read(addr_t addr, size_t len, void* bytes)
   }
 
   // now we're aligned
-  for (size_t pos = 0; pos < len; pos += cmemif->chunk_max_size())
-    cmemif->read_chunk(addr + pos, std::min(cmemif->chunk_max_size(), len - pos), (char*)bytes + pos);
+  if (len)
+    cmemif->read_chunks(addr, len, bytes);
 }
 
 void memif_t::write(addr_t addr, size_t len, const void* bytes)
 {
+  if (!shadows.empty())
+    drop_shadows(addr, len);
+  nwritten += len;
+
   size_t align = cmemif->chunk_align();
   if (len && (addr & (align-1)))
   {
@@ -70,17 +219,70 @@ void memif_t::write(addr_t addr, size_t len, const void* bytes)
   }
 
   // now we're aligned
-  bool all_zero = len != 0;
-  for (size_t i = 0; i < len; i++)
-    all_zero &= ((const char*)bytes)[i] == 0;
-
-  if (all_zero) {
-    cmemif->clear_chunk(addr, len);
-  } else {
-    size_t max_chunk = cmemif->chunk_max_size();
-    for (size_t pos = 0; pos < len; pos += max_chunk)
-      cmemif->write_chunk(addr + pos, std::min(max_chunk, len - pos), (char*)bytes + pos);
+  if (len)
+    write_aligned(addr, len, (const uint8_t*)bytes);
+}
+
+static bool all_zero(const uint8_t* bytes, size_t len)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 64 <= len; i += 64) {
+    __m128i v = _mm_or_si128(
+      _mm_or_si128(_mm_loadu_si128((const __m128i*)(bytes + i)),
+                   _mm_loadu_si128((const __m128i*)(bytes + i + 16))),
+      _mm_or_si128(_mm_loadu_si128((const __m128i*)(bytes + i + 32)),
+                   _mm_loadu_si128((const __m128i*)(bytes + i + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+      return false;
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    if (word)
+      return false;
   }
+  for (; i < len; i++)
+    if (bytes[i])
+      return false;
+  return true;
+}
+
+// Splits an aligned write into zero runs, which are cleared, and the data
+// around them. Runs are found a block at a time, and blocks are a multiple
+// of the chunk alignment, so every piece stays aligned.
+void memif_t::write_aligned(addr_t addr, size_t len, const uint8_t* bytes)
+{
+  size_t block = std::max<size_t>(MEMIF_ZERO_BLOCK, cmemif->chunk_align());
+  size_t done = 0; // bytes written or cleared
+  size_t pos = 0;
+  while (pos < len) {
+    size_t end = std::min(len, pos + block);
+    if (!all_zero(bytes + pos, end - pos)) {
+      pos = end;
+      continue;
+    }
+    size_t run = pos;
+    for (pos = end; pos < len; pos = end) {
+      end = std::min(len, pos + block);
+      if (!all_zero(bytes + pos, end - pos))
+        break;
+    }
+    if (pos - run >= zero_run_min || pos - run == len) {
+      write_data(addr + done, run - done, bytes + done);
+      cmemif->clear_chunk(addr + run, pos - run);
+      done = pos;
+    }
+  }
+  write_data(addr + done, len - done, bytes + done);
+}
+
+void memif_t::write_data(addr_t addr, size_t len, const uint8_t* bytes)
+{
+  size_t max_chunk = cmemif->chunk_max_size();
+  for (size_t pos = 0; pos < len; pos += max_chunk)
+    cmemif->write_chunk(addr + pos, std::min(max_chunk, len - pos), bytes + pos);
 }
 
 #define MEMIF_READ_FUNC \
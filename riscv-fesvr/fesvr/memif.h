@@ -5,11 +5,22 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <map>
+#include <vector>
 
 typedef uint64_t reg_t;
 typedef int64_t sreg_t;
 typedef reg_t addr_t;
 
+// One aligned access of a scatter-gather transfer, bytes is the source of
+// a write or the destination of a read
+struct chunk_op_t {
+  bool write;
+  addr_t addr;
+  size_t len;
+  uint8_t* bytes;
+};
+
 class chunked_memif_t
 {
 public:
@@ -17,20 +28,72 @@ public:
   virtual void write_chunk(addr_t taddr, size_t len, const void* src) = 0;
   virtual void clear_chunk(addr_t taddr, size_t len) = 0;
 
+  // read an aligned range that may span several chunks; transports that can
+  // keep more than one read in flight override this
+  virtual void read_chunks(addr_t taddr, size_t len, void* dst);
+
+  // run accesses in order, one at a time by default; transports that can
+  // keep several in flight override this to issue them back to back
+  virtual void transfer_chunks(const std::vector<chunk_op_t>& ops);
+
   virtual size_t chunk_align() = 0;
   virtual size_t chunk_max_size() = 0;
 };
 
+// Zero runs at least this long inside a write go to clear_chunk
+#define MEMIF_ZERO_RUN_MIN 4096
+
+class memif_t;
+
+// One access of a memif_batch_t. Write data is copied when the write is
+// queued, reads land in dst.
+struct memif_op_t {
+  bool write;
+  addr_t addr;
+  size_t len;
+  void* dst;
+  std::vector<uint8_t> data;
+};
+
+// Reads and writes collected with memif_t::batch() and run together by
+// submit(), so that transports can overlap their round trips. Accesses
+// take effect in the order they were queued, and nothing reaches the
+// target before submit().
+class memif_batch_t
+{
+public:
+  memif_batch_t(memif_t* memif) : memif(memif) {}
+
+  void read(addr_t addr, size_t len, void* bytes);
+  void write(addr_t addr, size_t len, const void* bytes);
+  // reads have landed once this returns, and the batch is empty again
+  void submit();
+
+private:
+  memif_t* memif;
+  std::vector<memif_op_t> ops;
+};
+
 class memif_t
 {
 public:
-  memif_t(chunked_memif_t* _cmemif) : cmemif(_cmemif) {}
+  memif_t(chunked_memif_t* _cmemif)
+    : cmemif(_cmemif), nread(0), nwritten(0), shadowing(false),
+      zero_run_min(MEMIF_ZERO_RUN_MIN) {}
   virtual ~memif_t(){}
 
   // read and write byte arrays
   virtual void read(addr_t addr, size_t len, void* bytes);
   virtual void write(addr_t addr, size_t len, const void* bytes);
 
+  // collect several reads and writes into one transfer
+  memif_batch_t batch() { return memif_batch_t(this); }
+  // Runs a batch. Aligned accesses become one transfer_chunks() call,
+  // unaligned writes and writes long enough to hold zero runs go through
+  // write() in order. Subclasses overriding read() or write() override this
+  // too if they are to see batched accesses.
+  virtual void submit(std::vector<memif_op_t>& ops);
+
   // read and write 8-bit words
   virtual uint8_t read_uint8(addr_t addr);
   virtual int8_t read_int8(addr_t addr);
@@ -55,8 +118,39 @@ public:
   virtual void write_uint64(addr_t addr, uint64_t val);
   virtual void write_int64(addr_t addr, int64_t val);
 
+  // Read-only shadow: a host copy of target memory the target is not
+  // expected to write, such as read-only ELF segments. Reads that fall
+  // entirely inside one shadowed range are served from the copy, writes
+  // through this memif drop the ranges they touch. Off until enabled.
+  void set_shadowing(bool enable);
+  virtual void shadow(addr_t addr, size_t len, const void* bytes);
+  // Write without dropping shadowed ranges, for short-lived patches that the
+  // caller puts back to what the shadow holds before anyone reads them
+  void patch(addr_t addr, size_t len, const void* bytes);
+
+  // Writes clear zero runs of at least this many bytes with clear_chunk
+  // instead of sending them, as well as writes that are zero throughout.
+  // Transports with a cheap clear may lower it, ~0 turns splitting off.
+  void set_zero_run_min(size_t bytes) { zero_run_min = bytes; }
+
+  // bytes that went to or came from the target, shadow hits not included
+  uint64_t bytes_read() { return nread; }
+  uint64_t bytes_written() { return nwritten; }
+
 protected:
   chunked_memif_t* cmemif;
+
+private:
+  uint64_t nread;
+  uint64_t nwritten;
+  bool shadowing;
+  std::map<addr_t, std::vector<uint8_t>> shadows; // by start address
+  bool read_shadow(addr_t addr, size_t len, void* bytes);
+  void drop_shadows(addr_t addr, size_t len);
+  size_t zero_run_min;
+  void write_aligned(addr_t addr, size_t len, const uint8_t* bytes);
+  void write_data(addr_t addr, size_t len, const uint8_t* bytes);
+  void add_chunks(std::vector<chunk_op_t>& chunks, bool write, addr_t addr, size_t len, uint8_t* bytes);
 };
 
 #endif // __MEMIF_H
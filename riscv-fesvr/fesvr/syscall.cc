@@ -252,8 +252,10 @@ reg_t syscall_t::sys_faccessat(reg_t dirfd, reg_t pname, reg_t len, reg_t mode,
 reg_t syscall_t::sys_renameat(reg_t odirfd, reg_t popath, reg_t olen, reg_t ndirfd, reg_t pnpath, reg_t nlen, reg_t a6)
 {
   std::vector<char> opath(olen), npath(nlen);
-  memif->read(popath, olen, &opath[0]);
-  memif->read(pnpath, nlen, &npath[0]);
+  memif_batch_t paths = memif->batch();
+  paths.read(popath, olen, &opath[0]);
+  paths.read(pnpath, nlen, &npath[0]);
+  paths.submit();
   return sysret_errno(renameat(fds.lookup(odirfd), int(odirfd) == RISCV_AT_FDCWD ? do_chroot(&opath[0]).c_str() : &opath[0],
                              fds.lookup(ndirfd), int(ndirfd) == RISCV_AT_FDCWD ? do_chroot(&npath[0]).c_str() : &npath[0]));
 }
@@ -261,8 +263,10 @@ reg_t syscall_t::sys_renameat(reg_t odirfd, reg_t popath, reg_t olen, reg_t ndir
 reg_t syscall_t::sys_linkat(reg_t odirfd, reg_t poname, reg_t olen, reg_t ndirfd, reg_t pnname, reg_t nlen, reg_t flags)
 {
   std::vector<char> oname(olen), nname(nlen);
-  memif->read(poname, olen, &oname[0]);
-  memif->read(pnname, nlen, &nname[0]);
+  memif_batch_t names = memif->batch();
+  names.read(poname, olen, &oname[0]);
+  names.read(pnname, nlen, &nname[0]);
+  names.submit();
   return sysret_errno(linkat(fds.lookup(odirfd), int(odirfd) == RISCV_AT_FDCWD ? do_chroot(&oname[0]).c_str() : &oname[0],
                              fds.lookup(ndirfd), int(ndirfd) == RISCV_AT_FDCWD ? do_chroot(&nname[0]).c_str() : &nname[0],
                              flags));
@@ -340,6 +344,7 @@ reg_t syscall_t::sys_chdir(reg_t path, reg_t a1, reg_t a2, reg_t a3, reg_t a4, r
 void syscall_t::dispatch(reg_t mm)
 {
   reg_t magicmem[8];
+  uint64_t bytes_read = memif->bytes_read(), bytes_written = memif->bytes_written();
   memif->read(mm, sizeof(magicmem), magicmem);
 
   reg_t n = magicmem[0];
@@ -349,6 +354,11 @@ void syscall_t::dispatch(reg_t mm)
   magicmem[0] = (this->*table[n])(magicmem[1], magicmem[2], magicmem[3], magicmem[4], magicmem[5], magicmem[6], magicmem[7]);
 
   memif->write(mm, sizeof(magicmem), magicmem);
+
+  stats_t& s = stats[n];
+  s.calls++;
+  s.bytes_read += memif->bytes_read() - bytes_read;
+  s.bytes_written += memif->bytes_written() - bytes_written;
 }
 
 reg_t fds_t::alloc(int fd)
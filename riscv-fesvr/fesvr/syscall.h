@@ -7,6 +7,7 @@
 #include "memif.h"
 #include <vector>
 #include <string>
+#include <map>
 
 class syscall_t;
 typedef reg_t (syscall_t::*syscall_func_t)(reg_t, reg_t, reg_t, reg_t, reg_t, reg_t, reg_t);
@@ -30,7 +31,15 @@ class syscall_t : public device_t
   syscall_t(htif_t*);
 
   void set_chroot(const char* where);
-  
+
+  // per syscall number, over the whole run
+  struct stats_t {
+    uint64_t calls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+  };
+  const std::map<reg_t, stats_t>& get_stats() { return stats; }
+
  private:
   const char* identity() { return "syscall_proxy"; }
 
@@ -38,6 +47,7 @@ class syscall_t : public device_t
   memif_t* memif;
   std::vector<syscall_func_t> table;
   fds_t fds;
+  std::map<reg_t, stats_t> stats;
 
   void handle_syscall(command_t cmd);
   void dispatch(addr_t mm);
@@ -1,26 +1,38 @@
 #include "tsi.h"
 #include <cstdio>
 #include <cstdlib>
+#include <algorithm>
 
 #define NHARTS_MAX 16
 
-void tsi_t::host_thread(void *arg)
+// Initial ring capacities in words, both grow to fit the largest burst
+#define IN_DATA_WORDS 4096
+#define OUT_DATA_WORDS 4096
+
+tsi_t::tsi_t(int argc, char** argv) : htif_t(argc, argv),
+  in_data(IN_DATA_WORDS), out_data(OUT_DATA_WORDS), reply_words(0),
+  stats(), read_depth(1), chunk_bytes(1024), wc_open(false)
 {
-  tsi_t *tsi = static_cast<tsi_t*>(arg);
-  tsi->run();
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg.find("+tsi_read_depth=") == 0)
+      read_depth = std::max(1L, strtol(arg.substr(16).c_str(), 0, 10));
+    // non-numeric values (e.g. "auto") are left to the transport
+    if (arg.find("+tsi_chunk=") == 0 && strtoull(arg.substr(11).c_str(), 0, 10))
+      set_chunk_max_size(strtoull(arg.substr(11).c_str(), 0, 10));
+  }
 
-  while (true)
-    tsi->target->switch_to();
+  host.start([this] { run(); });
 }
 
-tsi_t::tsi_t(int argc, char** argv) : htif_t(argc, argv)
+tsi_t::~tsi_t(void)
 {
-  target = context_t::current();
-  host.init(host_thread, this);
 }
 
-tsi_t::~tsi_t(void)
+void tsi_t::set_chunk_max_size(size_t nbytes)
 {
+  // whole words only, the length field counts 32-bit words
+  chunk_bytes = std::max(chunk_align(), nbytes & ~(chunk_align() - 1));
 }
 
 #define MSIP_BASE 0x2000000
@@ -30,13 +42,15 @@ void tsi_t::reset()
 {
   uint32_t one = 1;
 
+  write_barrier();
   write_chunk(MSIP_BASE, sizeof(uint32_t), &one);
+  write_barrier();
 }
 
 void tsi_t::push_addr(addr_t addr)
 {
   for (int i = 0; i < SAI_ADDR_CHUNKS; i++) {
-    in_data.push_back(addr & 0xffffffff);
+    in_data.push(addr & 0xffffffff);
     addr = addr >> 32;
   }
 }
@@ -44,72 +58,178 @@ void tsi_t::push_addr(addr_t addr)
 void tsi_t::push_len(addr_t len)
 {
   for (int i = 0; i < SAI_LEN_CHUNKS; i++) {
-    in_data.push_back(len & 0xffffffff);
+    in_data.push(len & 0xffffffff);
     len = len >> 32;
   }
 }
 
-void tsi_t::read_chunk(addr_t taddr, size_t nbytes, void* dst)
+void tsi_t::issue_read(addr_t taddr, size_t nbytes)
 {
-  uint32_t *result = static_cast<uint32_t*>(dst);
   size_t len = nbytes / sizeof(uint32_t);
 
-  in_data.push_back(SAI_CMD_READ);
+  in_data.push(SAI_CMD_READ);
   push_addr(taddr);
   push_len(len - 1);
+  reply_words += len;
+  stats.read_cmds++;
+  pending_reads.push_back(std::make_pair(std::chrono::steady_clock::now(), len));
+}
+
+void tsi_t::gather_read(size_t nbytes, void* dst)
+{
+  uint32_t *result = static_cast<uint32_t*>(dst);
+  size_t len = nbytes / sizeof(uint32_t);
+
+  wait_for_words(len);
+  out_data.copy(0, len, result);
+  out_data.consume(len);
+}
+
+// Suspends the host until n reply words are queued. The target side skips
+// resuming it before then instead of switching back and forth per word.
+void tsi_t::wait_for_words(size_t n)
+{
+  host_task_t::await([this, n] { return out_data.size() >= n; });
+}
+
+void tsi_t::read_chunk(addr_t taddr, size_t nbytes, void* dst)
+{
+  issue_read(taddr, nbytes);
+  gather_read(nbytes, dst);
+}
 
-  for (size_t i = 0; i < len; i++) {
-    while (out_data.empty())
-      switch_to_target();
-    result[i] = out_data.front();
-    out_data.pop_front();
+// Keep up to read_depth read commands queued back to back. The target
+// answers them strictly in order, so replies are gathered oldest first
+// while the next command is already on its way.
+void tsi_t::read_chunks(addr_t taddr, size_t nbytes, void* dst)
+{
+  size_t max_chunk = chunk_max_size();
+  size_t window = read_depth * max_chunk;
+  size_t issued = 0;
+
+  for (size_t done = 0; done < nbytes; done += max_chunk) {
+    while (issued < nbytes && issued - done < window) {
+      issue_read(taddr + issued, std::min(max_chunk, nbytes - issued));
+      issued += max_chunk;
+    }
+    gather_read(std::min(max_chunk, nbytes - done), (char*)dst + done);
   }
 }
 
+// Reads are issued ahead of their replies while they fit in the same
+// window as read_chunks, which is at least one chunk, so a batch of small
+// reads costs one round trip. Writes are queued in between. The target runs
+// commands in order, so every access still sees the ones before it.
+void tsi_t::transfer_chunks(const std::vector<chunk_op_t>& ops)
+{
+  size_t window = read_depth * chunk_max_size();
+  std::deque<const chunk_op_t*> inflight;
+  size_t inflight_bytes = 0;
+
+  for (auto& op : ops) {
+    if (op.write) {
+      write_chunk(op.addr, op.len, op.bytes);
+      continue;
+    }
+    while (!inflight.empty() && inflight_bytes + op.len > window) {
+      gather_read(inflight.front()->len, inflight.front()->bytes);
+      inflight_bytes -= inflight.front()->len;
+      inflight.pop_front();
+    }
+    issue_read(op.addr, op.len);
+    inflight.push_back(&op);
+    inflight_bytes += op.len;
+  }
+  for (auto op : inflight)
+    gather_read(op->len, op->bytes);
+}
+
 void tsi_t::write_chunk(addr_t taddr, size_t nbytes, const void* src)
 {
   const uint32_t *src_data = static_cast<const uint32_t*>(src);
   size_t len = nbytes / sizeof(uint32_t);
+  const size_t header = 1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS;
+
+  // Anything queued behind the last write (a read, say) closes the window,
+  // so merging never reorders accesses
+  if (wc_open && wc_cmd >= in_data.head_index() &&
+      wc_cmd + header + wc_len == in_data.tail_index() &&
+      wc_addr + wc_len * sizeof(uint32_t) == taddr &&
+      (wc_len + len) * sizeof(uint32_t) <= chunk_max_size()) {
+    wc_len += len;
+    addr_t wc_lenm1 = wc_len - 1;
+    for (int i = 0; i < SAI_LEN_CHUNKS; i++) {
+      in_data.at(wc_cmd + 1 + SAI_ADDR_CHUNKS + i) = wc_lenm1 & 0xffffffff;
+      wc_lenm1 = wc_lenm1 >> 32;
+    }
+  } else {
+    wc_open = true;
+    wc_cmd = in_data.tail_index();
+    wc_addr = taddr;
+    wc_len = len;
+
+    in_data.push(SAI_CMD_WRITE);
+    push_addr(taddr);
+    push_len(len - 1);
+    stats.write_cmds++;
+  }
 
-  in_data.push_back(SAI_CMD_WRITE);
-  push_addr(taddr);
-  push_len(len - 1);
-
-  in_data.insert(in_data.end(), src_data, src_data + len);
+  in_data.push_words(src_data, len);
 }
 
 void tsi_t::send_word(uint32_t word)
 {
-  out_data.push_back(word);
+  send_words(&word, 1);
+}
+
+void tsi_t::send_words(const uint32_t* words, size_t n)
+{
+  out_data.push_words(words, n);
+  reply_words -= std::min(reply_words, n);
+  stats.words_received += n;
+
+  // Time every read whose last reply word is among these
+  std::chrono::steady_clock::time_point now;
+  for (size_t left = n; left && !pending_reads.empty(); ) {
+    size_t take = std::min(left, pending_reads.front().second);
+    left -= take;
+    if ((pending_reads.front().second -= take))
+      break;
+    if (now == std::chrono::steady_clock::time_point())
+      now = std::chrono::steady_clock::now();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - pending_reads.front().first).count();
+    pending_reads.pop_front();
+    stats.read_latency_ns += ns;
+    size_t bucket = 0;
+    while (bucket < TSI_LATENCY_BUCKETS - 1 && (uint64_t) ns >= (1000ULL << bucket))
+      bucket++;
+    stats.read_latency[bucket]++;
+  }
 }
 
 uint32_t tsi_t::recv_word(void)
 {
   uint32_t word = in_data.front();
-  in_data.pop_front();
+  consume_words(1);
   return word;
 }
 
 bool tsi_t::data_available(void)
 {
-  return !in_data.empty();
-}
-
-void tsi_t::switch_to_host(void)
-{
-  host.switch_to();
+  return in_valid();
 }
 
-void tsi_t::switch_to_target(void)
+void tsi_t::consume_words(size_t n)
 {
-  target->switch_to();
+  stats.words_sent += n;
+  in_data.consume(n);
 }
 
 void tsi_t::tick(bool out_valid, uint32_t out_bits, bool in_ready)
 {
   if (out_valid && out_ready())
-    out_data.push_back(out_bits);
+    send_word(out_bits);
 
   if (in_valid() && in_ready)
-    in_data.pop_front();
+    consume_words(1);
 }
@@ -2,11 +2,14 @@
 #define __SAI_H
 
 #include "htif.h"
-#include "context.h"
+#include "host_task.h"
 
 #include <string>
 #include <vector>
 #include <deque>
+#include <algorithm>
+#include <string.h>
+#include <chrono>
 #include <stdint.h>
 
 #define SAI_CMD_READ 0
@@ -15,6 +18,90 @@
 #define SAI_ADDR_CHUNKS 2
 #define SAI_LEN_CHUNKS 2
 
+// Read latency buckets, bucket i counts reads that took under 2^i us and
+// the last one everything slower
+#define TSI_LATENCY_BUCKETS 24
+
+struct tsi_stats_t {
+  uint64_t read_cmds;
+  uint64_t write_cmds;
+  uint64_t words_sent; // commands and write data
+  uint64_t words_received;
+  uint64_t read_latency_ns; // summed from queueing to the last reply word
+  uint64_t read_latency[TSI_LATENCY_BUCKETS];
+};
+
+// Power-of-two ring of words. Indices run free and are only masked on
+// access, so an index into the ring stays valid until its word is consumed.
+// The capacity doubles whenever a push does not fit, so after the first
+// large burst it stays fixed.
+class tsi_ring_t
+{
+ public:
+  tsi_ring_t(size_t capacity) : buf(capacity), head(0), tail(0) {}
+
+  size_t size() { return tail - head; }
+  bool empty() { return head == tail; }
+  size_t head_index() { return head; }
+  size_t tail_index() { return tail; }
+  uint32_t& at(size_t index) { return buf[index & (buf.size() - 1)]; }
+  uint32_t front() { return at(head); }
+
+  void push(uint32_t word)
+  {
+    reserve(1);
+    at(tail++) = word;
+  }
+
+  void push_words(const uint32_t* words, size_t n)
+  {
+    reserve(n);
+    size_t pos = tail & (buf.size() - 1);
+    size_t first = std::min(n, buf.size() - pos);
+    memcpy(&buf[pos], words, first * sizeof(uint32_t));
+    memcpy(&buf[0], words + first, (n - first) * sizeof(uint32_t));
+    tail += n;
+  }
+
+  // The queued words from the head up to the tail or the end of the
+  // buffer, whichever comes first
+  size_t peek_contiguous(const uint32_t** words)
+  {
+    size_t pos = head & (buf.size() - 1);
+    *words = &buf[pos];
+    return std::min(size(), buf.size() - pos);
+  }
+
+  // Copies n words starting offset words past the head
+  void copy(size_t offset, size_t n, uint32_t* dst)
+  {
+    size_t pos = (head + offset) & (buf.size() - 1);
+    size_t first = std::min(n, buf.size() - pos);
+    memcpy(dst, &buf[pos], first * sizeof(uint32_t));
+    memcpy(dst + first, &buf[0], (n - first) * sizeof(uint32_t));
+  }
+
+  void consume(size_t n) { head += n; }
+
+ private:
+  void reserve(size_t n)
+  {
+    if (size() + n <= buf.size())
+      return;
+    size_t capacity = buf.size();
+    while (capacity < size() + n)
+      capacity *= 2;
+    std::vector<uint32_t> grown(capacity);
+    for (size_t i = head; i != tail; i++)
+      grown[i & (capacity - 1)] = at(i);
+    buf.swap(grown);
+  }
+
+  std::vector<uint32_t> buf;
+  size_t head;
+  size_t tail;
+};
+
 class tsi_t : public htif_t
 {
  public:
@@ -22,11 +109,33 @@ class tsi_t : public htif_t
   virtual ~tsi_t();
 
   bool data_available();
+  // number of read-reply words requested from the target but not yet received
+  size_t reply_words_pending() { return reply_words; }
   void send_word(uint32_t word);
+  // bulk form of send_word, for transports that receive whole runs
+  void send_words(const uint32_t* words, size_t n);
   uint32_t recv_word();
-  void switch_to_host();
+  // Resumes the host, which runs htif_t::run() as a host_task_t, unless it
+  // awaits reply words that have not all arrived yet, so transports can
+  // call this every cycle or every poll. A host that yielded for any other
+  // reason, such as idle(), is still resumed on every call.
+  void switch_to_host() { host.poll(); }
+  bool host_runnable() { return host.runnable(); }
+  // for running the hosts of several chips from one host_scheduler_t
+  host_task_t* host_task() { return &host; }
+
+  // Queued outbound words, for transports that move them in bulk.
+  // peek_words() returns the longest contiguous run at the front, which may
+  // stop short of the queue's end where the ring wraps. Release the words
+  // that were sent with consume_words().
+  size_t peek_words(const uint32_t** words) { return in_data.peek_contiguous(words); }
+  size_t words_queued() { return in_data.size(); }
+  void copy_words(size_t offset, size_t n, uint32_t* dst) { in_data.copy(offset, n, dst); }
+  void consume_words(size_t n);
 
-  uint32_t in_bits() { return in_data.front(); }
+  const tsi_stats_t& get_stats() { return stats; }
+
+  uint32_t in_bits() { return in_valid() ? in_data.front() : 0; }
   bool in_valid() { return !in_data.empty(); }
   bool out_ready() { return true; }
   void tick(bool out_valid, uint32_t out_bits, bool in_ready);
@@ -34,24 +143,51 @@ class tsi_t : public htif_t
  protected:
   void reset() override;
   void read_chunk(addr_t taddr, size_t nbytes, void* dst) override;
+  void read_chunks(addr_t taddr, size_t nbytes, void* dst) override;
   void write_chunk(addr_t taddr, size_t nbytes, const void* src) override;
-  void switch_to_target();
+  void transfer_chunks(const std::vector<chunk_op_t>& ops) override;
+  // suspends the host until the next switch_to_host()
+  void switch_to_target() { host_task_t::yield(); }
 
   size_t chunk_align() { return 4; }
-  size_t chunk_max_size() { return 1024; }
+  size_t chunk_max_size() { return chunk_bytes; }
+  // defaults to 1024, +tsi_chunk= or a subclass (e.g. after calibrating its
+  // link) may change it
+  void set_chunk_max_size(size_t nbytes);
+  // defaults to 1, +tsi_read_depth= or a subclass may change it
+  void set_read_depth(size_t depth) { read_depth = std::max<size_t>(1, depth); }
+  // stop merging later writes into the last queued one, for writes that
+  // must reach the target as separate transactions (e.g. MMIO registers)
+  void write_barrier() { wc_open = false; }
 
   int get_ipi_addrs(addr_t *addrs);
 
  private:
-  context_t host;
-  context_t* target;
-  std::deque<uint32_t> in_data;
-  std::deque<uint32_t> out_data;
+  host_task_t host;
+  tsi_ring_t in_data;
+  tsi_ring_t out_data;
+  size_t reply_words;
+
+  tsi_stats_t stats;
+  // reads not yet fully answered, as (queued at, reply words still due)
+  std::deque<std::pair<std::chrono::steady_clock::time_point, size_t>> pending_reads;
+
+  // reads kept in flight by read_chunks, set with +tsi_read_depth=
+  size_t read_depth;
+  size_t chunk_bytes;
+
+  // Write combining: the last queued write command is extended in place
+  // while its header is still unsent and nothing was queued behind it
+  bool wc_open;
+  size_t wc_cmd; // ring index of its command word in in_data
+  addr_t wc_addr;
+  size_t wc_len; // in words
 
   void push_addr(addr_t addr);
   void push_len(addr_t len);
-
-  static void host_thread(void *tsi);
+  void issue_read(addr_t taddr, size_t nbytes);
+  void gather_read(size_t nbytes, void* dst);
+  void wait_for_words(size_t n);
 };
 
 #endif
@@ -7,54 +7,234 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <termios.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <chrono>
+#include <stdarg.h>
+#include <stdexcept>
+#include <fesvr/encoding.h>
+#include "uart_baud.h"
 
+// How long handle_uart sleeps on the tty while waiting for a read reply, and
+// while the host has gone idle with nothing in flight. Both are upper bounds:
+// any RX byte wakes the loop immediately.
+#define UART_REPLY_TIMEOUT_MS 100
+#define UART_IDLE_TIMEOUT_MS 10
+
+// RX byte ring, must be a power of two
+#define UART_RX_RING_SIZE (64 * 1024)
+
+// Default address read by +baudrate=auto and the connection handshake, the
+// bootrom is always readable and has no side effects. Override with
+// +probe_addr=0x...
+#define UART_PROBE_ADDR 0x10000
+
+// How long the handshake waits for its first reply, doubled on each retry
+#define UART_HANDSHAKE_TIMEOUT_MS 5
+#define UART_HANDSHAKE_ATTEMPTS 9
+
+
+// Candidate chunk sizes for +tsi_chunk=auto, smallest first. A size is only
+// kept if it is at least UART_CALIB_MIN_GAIN times faster than the last one.
+static const size_t calib_chunk_sizes[] = { 256, 1024, 4096, 16384, 65536 };
+#define UART_CALIB_MIN_GAIN 1.05
+
+// How often +stats prints a line
+#define UART_STATS_INTERVAL_S 10
+
+// Granularity at which +image_cache tracks what the target already holds
+#define UART_IMAGE_CACHE_EXTENT (64 * 1024)
+
+// Candidate rates for +baudrate=auto, fastest first
+static const uint64_t auto_baud_rates[] = {
+  4000000, 3000000, 2000000, 1500000, 1000000, 921600, 460800,
+  230400, 115200, 57600, 38400, 19200, 9600
+};
+
+// Ttys stay open for the rest of the process. The daemon (+daemon=) runs one
+// instance per job, and only the first one opens each tty and probes its
+// rate; later ones configure it afresh at that rate.
+struct uart_tty_t {
+  int fd;
+  uint64_t baud_rate;
+};
+static std::map<std::string, uart_tty_t> open_ttys;
+
+// Ends the current program with an error. It is thrown rather than exiting
+// so that a daemon (+daemon=) only fails the job, not every job after it.
+[[noreturn]] static void uart_error(const char* fmt, ...) {
+  char msg[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  throw std::runtime_error(msg);
+}
 
 testchip_uart_tsi_t::testchip_uart_tsi_t(int argc, char** argv,
 					 char* ttyfile, uint64_t baud_rate,
 					 bool verbose, bool do_self_check)
-  : testchip_tsi_t(argc, argv, false), verbose(verbose), in_load_program(false), do_self_check(do_self_check) {
+  : testchip_tsi_t(argc, argv, false), verbose(verbose), in_load_program(false), reset_before_load(false), do_self_check(do_self_check),
+    idle_handoffs(0), probe_addr(UART_PROBE_ADDR), do_calibrate_chunk(false),
+    do_compress_load(false), do_full_self_check(false), image_cache_path(""),
+    rx_ring(UART_RX_RING_SIZE), rx_head(0), rx_tail(0),
+    striping(false), stripe_switch(false), stripe_next(false),
+    flow_control(false), tx_stalls(0), tx_cts_stalls(0), tx_stall_time(0),
+    replaying(false), replay_tx(0), replay_rx(0),
+    stats_enabled(false), stats_at_last(), load_time(0), reply_wait_time(0), idle_time(0) {
+  stats_start = stats_last = std::chrono::steady_clock::now();
+  // .bss is far cheaper to zero on the target than over a UART
+  stub_memset = true;
 
-  uint64_t baud_sel = B115200;
-  switch (baud_rate) {
-  case 1200: baud_sel    = B1200; break;
-  case 1800: baud_sel    = B1800; break;
-  case 2400: baud_sel    = B2400; break;
-  case 4800: baud_sel    = B4800; break;
-  case 9600: baud_sel    = B9600; break;
-  case 19200: baud_sel   = B19200; break;
-  case 38400: baud_sel   = B38400; break;
-  case 57600: baud_sel   = B57600; break;
-  case 115200: baud_sel  = B115200; break;
- default:
-    printf("Unsupported baud rate %ld\n", baud_rate);
-    exit(1);
+  std::vector<std::string> args(argv + 1, argv + argc);
+  for (auto& arg : args) {
+    if (arg.find("+probe_addr=0x") == 0)
+      probe_addr = strtoull(arg.substr(14).c_str(), 0, 16);
+    if (arg == "+tsi_chunk=auto")
+      do_calibrate_chunk = true;
+    if (arg == "+compress_load")
+      do_compress_load = true;
+    if (arg == "+selfcheck=full")
+      do_full_self_check = true;
+    if (arg.find("+image_cache=") == 0)
+      image_cache_path = arg.substr(13);
+    if (arg == "+image_cache")
+      image_cache_path = default_image_cache_path(ttyfile);
+    if (arg == "+flowctl=rts")
+      flow_control = true;
+    if (arg == "+stats" || arg.find("+stats=") == 0)
+      stats_enabled = true;
+    if (arg.find("+stats=") == 0)
+      stats_path = arg.substr(7);
+    if (arg.find("+trace=") == 0 && !trace.open(arg.substr(7))) {
+      uart_error("Could not open trace %s, error %i: %s", arg.substr(7).c_str(), errno, strerror(errno));
+    }
+    if (arg.find("+replay=") == 0) {
+      if (!replay.open(arg.substr(8))) {
+        uart_error("Could not read trace %s", arg.substr(8).c_str());
+      }
+      replaying = true;
+    }
+  }
+
+  // Nothing to open, the trace answers instead of the target
+  if (replaying) {
+    printf("Replaying %ld TX and %ld RX words\n", replay.tx.size(), replay.rx.size());
+    ttyfd = -1;
+    return;
   }
 
-  if (baud_sel != B115200) {
+  if (baud_rate != 0 && baud_rate != 115200) {
     printf("Warning: You selected a non-standard baudrate. This will only work if the HW was configured with this baud-rate\n");
   }
-#ifdef __APPLE__
-  ttyfd = open(ttyfile, O_RDWR | O_NOCTTY | O_NDELAY);
-  if (ttyfd < 0) {
-    printf("Error %i from open: %s\n", errno, strerror(errno));
-    exit(1);
+
+  std::vector<std::string> ttys;
+  std::string tty_list(ttyfile);
+  for (size_t pos = 0; pos <= tty_list.size(); ) {
+    size_t comma = std::min(tty_list.find(',', pos), tty_list.size());
+    ttys.push_back(tty_list.substr(pos, comma - pos));
+    pos = comma + 1;
+  }
+
+  // A cached tty still has an earlier job's settings, e.g. +flowctl=rts
+  auto cached = open_ttys.find(ttys[0]);
+  if (cached != open_ttys.end()) {
+    ttyfd = cached->second.fd;
+    baud_rate = cached->second.baud_rate;
+    configure_tty(ttyfd);
+    set_baud_rate(ttyfd, baud_rate);
+  } else {
+    ttyfd = open_tty(ttys[0].c_str());
+    try {
+      if (baud_rate == 0) {
+        baud_rate = auto_baud_rate();
+      } else if (!set_baud_rate(ttyfd, baud_rate)) {
+        uart_error("Unsupported baud rate %ld", baud_rate);
+      }
+    } catch (...) {
+      // not cached yet, nothing else would close it
+      close(ttyfd);
+      throw;
+    }
+    open_ttys[ttys[0]] = { ttyfd, baud_rate };
+  }
+
+  // Back-pressure comes from CTS, so whole bursts can be handed to the tty.
+  // write_bytes waits for the tty to drain and counts every time it has to.
+  if (flow_control && !set_flow_control(ttyfd)) {
+    uart_error("Could not enable RTS/CTS flow control, error %i: %s", errno, strerror(errno));
   }
   int flags = fcntl(ttyfd, F_GETFL, 0);
-  fcntl(ttyfd, F_SETFL, flags & ~O_NONBLOCK);
+  fcntl(ttyfd, F_SETFL, flow_control ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+
+  // The other links are expected to run at the same rate as the first
+  if (ttys.size() > 1) {
+    for (size_t i = 0; i < ttys.size(); i++) {
+      uart_link_t link = {};
+      if (i == 0) {
+        link.fd = ttyfd;
+      } else if (open_ttys.count(ttys[i])) {
+        link.fd = open_ttys[ttys[i]].fd;
+        configure_tty(link.fd);
+        set_baud_rate(link.fd, baud_rate);
+      } else {
+        link.fd = open_tty(ttys[i].c_str());
+        if (!set_baud_rate(link.fd, baud_rate)) {
+          close(link.fd);
+          uart_error("Unsupported baud rate %ld on %s", baud_rate, ttys[i].c_str());
+        }
+        open_ttys[ttys[i]] = { link.fd, baud_rate };
+      }
+      if (flow_control && !set_flow_control(link.fd)) {
+        uart_error("Could not enable RTS/CTS flow control on %s, error %i: %s", ttys[i].c_str(), errno, strerror(errno));
+      }
+      // handle_links multiplexes all of them with select()
+      fcntl(link.fd, F_SETFL, fcntl(link.fd, F_GETFL, 0) | O_NONBLOCK);
+      links.push_back(link);
+    }
+    // Striped reads only overlap if enough of them are in flight
+    if (std::none_of(args.begin(), args.end(), [](const std::string &arg) {
+          return arg.find("+tsi_read_depth=") == 0; }))
+      set_read_depth(2 * links.size());
+    printf("Striping bulk transfers across %ld links\n", links.size());
+  }
+};
+
+int testchip_uart_tsi_t::open_tty(const char* ttyfile) {
+  int fd;
+#ifdef __APPLE__
+  fd = open(ttyfile, O_RDWR | O_NOCTTY | O_NDELAY);
+  if (fd < 0) {
+    uart_error("Could not open %s, error %i: %s", ttyfile, errno, strerror(errno));
+  }
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
 #else
-  ttyfd = open(ttyfile, O_RDWR);
-  if (ttyfd < 0) {
-    printf("Error %i from open: %s\n", errno, strerror(errno));
-    exit(1);
+  fd = open(ttyfile, O_RDWR);
+  if (fd < 0) {
+    uart_error("Could not open %s, error %i: %s", ttyfile, errno, strerror(errno));
   }
 #endif
+  try {
+    configure_tty(fd);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  return fd;
+}
 
+// Raw 8N1 at 115200 without flow control, whatever an earlier user of the
+// tty left behind
+void testchip_uart_tsi_t::configure_tty(int fd) {
   // https://blog.mbedded.ninja/programming/operating-systems/linux/linux-serial-ports-using-c-cpp/
   struct termios tty;
 
-  if (tcgetattr(ttyfd, &tty) != 0) {
-    printf("Error %i from tcgetaddr: %s\n", errno, strerror(errno));
-    exit(1);
+  if (tcgetattr(fd, &tty) != 0) {
+    uart_error("tcgetattr failed with error %i: %s", errno, strerror(errno));
   }
 
   tty.c_cflag &= ~PARENB; // Clear parity bit, disabling parity (most common)
@@ -79,186 +259,973 @@ testchip_uart_tsi_t::testchip_uart_tsi_t(int argc, char** argv,
   tty.c_cc[VTIME] = 0;
   tty.c_cc[VMIN] = 0;
 
-  // Set in/out baud rate to be B115200
-  cfsetispeed(&tty, baud_sel);
-  cfsetospeed(&tty, baud_sel);
+  // Start out at B115200, the caller picks the real rate with set_baud_rate
+  cfsetispeed(&tty, B115200);
+  cfsetospeed(&tty, B115200);
 
   // Save tty settings, also checking for error
-  if (tcsetattr(ttyfd, TCSANOW, &tty) != 0) {
+  if (tcsetattr(fd, TCSANOW, &tty) != 0) {
     printf("Error %i from tcsetattr: %s\n", errno, strerror(errno));
   }
-};
+}
 
-bool testchip_uart_tsi_t::handle_uart() {
-  std::vector<uint16_t> to_write;
-  while (data_available()) {
-     uint32_t d = recv_word();
-     to_write.push_back(d);
-     to_write.push_back(d >> 16);
+bool testchip_uart_tsi_t::set_flow_control(int fd) {
+  struct termios tty;
+  if (tcgetattr(fd, &tty) != 0)
+    return false;
+  tty.c_cflag |= CRTSCTS;
+  return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+// The tty didn't take all of a write. Note whether the target is holding
+// off CTS, or the host side buffer simply filled up (or the line state is
+// unknown, as on a pty).
+void testchip_uart_tsi_t::note_tx_stall(int fd) {
+  tx_stalls++;
+  int status;
+  if (ioctl(fd, TIOCMGET, &status) == 0 && !(status & TIOCM_CTS))
+    tx_cts_stalls++;
+}
+
+void testchip_uart_tsi_t::print_flow_control_stats() {
+  if (!flow_control)
+    return;
+  printf("Flow control: %ld write stalls, %ld with CTS deasserted, %.1f ms stalled\n",
+         tx_stalls, tx_cts_stalls, tx_stall_time * 1000);
+}
+
+void testchip_uart_tsi_t::note_wait(std::chrono::steady_clock::time_point start, bool idle) {
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  (idle ? idle_time : reply_wait_time) += secs;
+}
+
+void testchip_uart_tsi_t::print_stats_line(bool final) {
+  auto now = std::chrono::steady_clock::now();
+  const tsi_stats_t &s = get_stats();
+  double secs = std::chrono::duration<double>(now - stats_last).count();
+  uint64_t tx = (s.words_sent - stats_at_last.words_sent) * sizeof(uint32_t);
+  uint64_t rx = (s.words_received - stats_at_last.words_received) * sizeof(uint32_t);
+  uint64_t reads = s.read_cmds - stats_at_last.read_cmds;
+  double latency = reads ? (s.read_latency_ns - stats_at_last.read_latency_ns) / 1e6 / reads : 0;
+  printf("Stats%s: %.1f s, TX %ld B (%.0f B/s), RX %ld B (%.0f B/s), %ld reads (%.2f ms avg), "
+         "%ld writes, %ld polls (%ld hits)\n",
+         final ? " (total)" : "", std::chrono::duration<double>(now - stats_start).count(),
+         tx, tx / secs, rx, rx / secs, reads, latency, s.write_cmds - stats_at_last.write_cmds,
+         poll_count(), poll_hit_count());
+  fflush(stdout);
+  stats_last = now;
+  stats_at_last = s;
+}
+
+void testchip_uart_tsi_t::report_stats() {
+  if (!stats_enabled)
+    return;
+  // The final line covers the whole run
+  stats_last = stats_start;
+  stats_at_last = tsi_stats_t();
+  print_stats_line(true);
+  if (!stats_path.empty())
+    write_stats_json();
+}
+
+void testchip_uart_tsi_t::write_stats_json() {
+  FILE* f = fopen(stats_path.c_str(), "w");
+  if (!f) {
+    printf("Warning: Could not write stats to %s: %s\n", stats_path.c_str(), strerror(errno));
+    return;
   }
+  const tsi_stats_t &s = get_stats();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start).count();
+  fprintf(f, "{\n");
+  fprintf(f, "  \"elapsed_s\": %.6f,\n", elapsed);
+  fprintf(f, "  \"load_s\": %.6f,\n", load_time);
+  fprintf(f, "  \"command_s\": %.6f,\n", command_seconds());
+  fprintf(f, "  \"reply_wait_s\": %.6f,\n", reply_wait_time);
+  fprintf(f, "  \"idle_s\": %.6f,\n", idle_time);
+  fprintf(f, "  \"tx_bytes\": %ld,\n", s.words_sent * sizeof(uint32_t));
+  fprintf(f, "  \"rx_bytes\": %ld,\n", s.words_received * sizeof(uint32_t));
+  fprintf(f, "  \"commands\": { \"read\": %ld, \"write\": %ld },\n", s.read_cmds, s.write_cmds);
+  fprintf(f, "  \"chunk_bytes\": %ld,\n", chunk_max_size());
+  fprintf(f, "  \"read_latency\": {\n");
+  fprintf(f, "    \"mean_us\": %.3f,\n", s.read_cmds ? s.read_latency_ns / 1e3 / s.read_cmds : 0.0);
+  fprintf(f, "    \"histogram\": [");
+  // Bucket i holds reads under 2^i us, the last one has no upper bound
+  bool first = true;
+  for (size_t i = 0; i < TSI_LATENCY_BUCKETS; i++) {
+    if (!s.read_latency[i])
+      continue;
+    if (i + 1 < TSI_LATENCY_BUCKETS)
+      fprintf(f, "%s\n      { \"under_us\": %llu, \"count\": %ld }", first ? "" : ",", 1ULL << i, s.read_latency[i]);
+    else
+      fprintf(f, "%s\n      { \"under_us\": null, \"count\": %ld }", first ? "" : ",", s.read_latency[i]);
+    first = false;
+  }
+  fprintf(f, "%s]\n  },\n", first ? "" : "\n    ");
+  fprintf(f, "  \"polls\": %ld,\n", poll_count());
+  fprintf(f, "  \"tohost_hits\": %ld,\n", poll_hit_count());
+  fprintf(f, "  \"syscalls\": {");
+  first = true;
+  for (auto &it : syscall_stats()) {
+    fprintf(f, "%s\n    \"%ld\": { \"calls\": %ld, \"bytes_read\": %ld, \"bytes_written\": %ld }",
+            first ? "" : ",", it.first, it.second.calls, it.second.bytes_read, it.second.bytes_written);
+    first = false;
+  }
+  fprintf(f, "%s}\n}\n", first ? "" : "\n  ");
+  fclose(f);
+  printf("Wrote stats to %s\n", stats_path.c_str());
+}
 
-  uint8_t* buf = (uint8_t*) to_write.data();
-  size_t write_size = to_write.size() * 2;
-  size_t written = 0;
-  size_t remaining = write_size;
+bool testchip_uart_tsi_t::set_baud_rate(int fd, uint64_t baud_rate) {
+  speed_t baud_sel;
+  switch (baud_rate) {
+  case 1200: baud_sel    = B1200; break;
+  case 1800: baud_sel    = B1800; break;
+  case 2400: baud_sel    = B2400; break;
+  case 4800: baud_sel    = B4800; break;
+  case 9600: baud_sel    = B9600; break;
+  case 19200: baud_sel   = B19200; break;
+  case 38400: baud_sel   = B38400; break;
+  case 57600: baud_sel   = B57600; break;
+  case 115200: baud_sel  = B115200; break;
+  case 230400: baud_sel  = B230400; break;
+  default:
+    // Anything outside the POSIX table goes through termios2/BOTHER on
+    // Linux or IOSSIOSPEED on macOS
+    return uart_set_custom_baud(fd, baud_rate);
+  }
+
+  struct termios tty;
+  if (tcgetattr(fd, &tty) != 0)
+    return false;
+  cfsetispeed(&tty, baud_sel);
+  cfsetospeed(&tty, baud_sel);
+  return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+uint64_t testchip_uart_tsi_t::auto_baud_rate() {
+  for (uint64_t baud_rate : auto_baud_rates) {
+    if (!set_baud_rate(ttyfd, baud_rate))
+      continue;
+    printf("Probing baud rate %ld\n", baud_rate);
+    // Let the line settle at the new rate and drop whatever the last
+    // attempt left behind in either direction
+    usleep(10000);
+    tcflush(ttyfd, TCIOFLUSH);
+    if (probe_link(baud_rate)) {
+      printf("Detected baud rate %ld\n", baud_rate);
+      return baud_rate;
+    }
+  }
+  uart_error("No baud rate produced well-formed replies from address %lx", probe_addr);
+}
+
+bool testchip_uart_tsi_t::probe_link(uint64_t baud_rate) {
+  // Issue the same two-word TSI read twice. At a wrong rate the target
+  // sees garbage and either stays silent or answers with the wrong length,
+  // so insist on exactly the expected bytes, nothing trailing, and
+  // matching data both times.
+  const uint32_t cmd[1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS] = {
+    SAI_CMD_READ, (uint32_t) probe_addr, (uint32_t) (probe_addr >> 32), 1, 0
+  };
+  // 10 bits per byte on the wire, plus slack for USB-UART latency
+  int timeout_ms = 20 + (10 * 1000 * (sizeof(cmd) + 8)) / baud_rate;
+
+  uint32_t reply[2][2];
+  for (int attempt = 0; attempt < 2; attempt++) {
+    write_bytes((const uint8_t*) cmd, sizeof(cmd));
+    uint8_t* dst = (uint8_t*) reply[attempt];
+    size_t got = 0;
+    while (got < sizeof(reply[attempt]) && wait_readable(ttyfd, timeout_ms)) {
+      int n = read(ttyfd, dst + got, sizeof(reply[attempt]) - got);
+      if (n <= 0)
+        break;
+      got += n;
+    }
+    if (got != sizeof(reply[attempt]))
+      return false;
+    if (wait_readable(ttyfd, timeout_ms)) // trailing garbage
+      return false;
+  }
+  return memcmp(reply[0], reply[1], sizeof(reply[0])) == 0;
+}
 
+void testchip_uart_tsi_t::write_bytes(const uint8_t* buf, size_t len) {
+  size_t remaining = len;
   while (remaining > 0) {
-    written = write(ttyfd, buf + write_size - remaining, remaining);
+    ssize_t written = write(ttyfd, buf + len - remaining, remaining);
+    if (written < 0) {
+      if (errno == EAGAIN && flow_control) {
+        written = 0;
+      } else if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      } else {
+        uart_error("write failed with error %i: %s", errno, strerror(errno));
+      }
+    }
     remaining = remaining - written;
+    if (remaining > 0 && flow_control) {
+      note_tx_stall(ttyfd);
+      auto start = std::chrono::steady_clock::now();
+      wait_writable(ttyfd);
+      std::chrono::duration<double> stalled = std::chrono::steady_clock::now() - start;
+      tx_stall_time += stalled.count();
+    }
   }
-  if (verbose) {
-    for (size_t i = 0; i < to_write.size() * 2; i++) {
-      printf("Wrote %x\n", buf[i]);
+}
+
+void testchip_uart_tsi_t::wait_writable(int fd) {
+  fd_set wfds;
+  FD_ZERO(&wfds);
+  FD_SET(fd, &wfds);
+  if (select(fd + 1, NULL, &wfds, NULL, NULL) < 0 && errno != EINTR) {
+    uart_error("select failed with error %i: %s", errno, strerror(errno));
+  }
+}
+
+bool testchip_uart_tsi_t::wait_readable(int fd, int timeout_ms) {
+  // select() rather than poll(): poll() does not support tty devices on macOS
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  int r = select(fd + 1, &rfds, NULL, NULL, &tv);
+  if (r < 0 && errno != EINTR) {
+    uart_error("select failed with error %i: %s", errno, strerror(errno));
+  }
+  return r > 0;
+}
+
+bool testchip_uart_tsi_t::handle_uart() {
+  if (stats_enabled && std::chrono::steady_clock::now() - stats_last >= std::chrono::seconds(UART_STATS_INTERVAL_S))
+    print_stats_line(false);
+  if (replaying)
+    return handle_replay();
+  if (!links.empty())
+    return handle_links();
+
+  // Send straight out of tsi_t's queue, no intermediate copy
+  const uint32_t* words;
+  size_t write_size = 0;
+  while (size_t nwords = peek_words(&words)) {
+    const uint8_t* buf = (const uint8_t*) words;
+    write_bytes(buf, nwords * sizeof(uint32_t));
+    if (verbose) {
+      for (size_t i = 0; i < nwords * sizeof(uint32_t); i++) {
+        printf("Wrote %x\n", buf[i]);
+      }
     }
+    if (trace.is_open())
+      trace.tx(words, nwords);
+    consume_words(nwords);
+    write_size += nwords * sizeof(uint32_t);
   }
 
-  uint8_t read_buf[256];
-  int n = read(ttyfd, &read_buf, sizeof(read_buf));
-  if (n < 0) {
-    printf("Error %i from read: %s\n", errno, strerror(errno));
-    exit(1);
+  // The htif host runs on this thread and only hands back once it is blocked
+  // on a read reply or has gone idle, so all of its new in_data has already
+  // been flushed above. Sleep on the tty until the target answers instead of
+  // spinning on empty reads. An idle host that keeps handing back with nothing
+  // in flight is throttled the same way.
+  // Every complete word is drained below, so at most a partial word is ever
+  // left over in the ring here.
+  int timeout_ms = 0;
+  if (reply_words_pending()) {
+    idle_handoffs = 0;
+    timeout_ms = UART_REPLY_TIMEOUT_MS;
+  } else if (write_size > 0) {
+    idle_handoffs = 0;
+  } else if (++idle_handoffs > 1 && !done()) {
+    timeout_ms = UART_IDLE_TIMEOUT_MS;
   }
-  for (int i = 0; i < n; i++) {
-    read_bytes.push_back(read_buf[i]);
+
+  bool readable = true;
+  if (timeout_ms) {
+    auto start = std::chrono::steady_clock::now();
+    readable = wait_readable(ttyfd, timeout_ms);
+    note_wait(start, !reply_words_pending());
+  }
+
+  ssize_t n = 0;
+  if (readable) {
+    // Read straight into the free space of the ring, which wraps into at
+    // most two segments
+    size_t mask = rx_ring.size() - 1;
+    size_t tail = rx_tail & mask;
+    size_t free_bytes = rx_ring.size() - (rx_tail - rx_head);
+    size_t first = std::min(free_bytes, rx_ring.size() - tail);
+    struct iovec iov[2] = {
+      { &rx_ring[tail], first },
+      { &rx_ring[0], free_bytes - first }
+    };
+    n = readv(ttyfd, iov, iov[1].iov_len ? 2 : 1);
+    if (n < 0) {
+      if (errno != EINTR && errno != EAGAIN) {
+        uart_error("read failed with error %i: %s", errno, strerror(errno));
+      }
+      n = 0;
+    }
+    rx_tail += n;
   }
 
-  if (read_bytes.size() >= 4) {
-    uint32_t out_data = 0;
-    uint8_t* b = ((uint8_t*)&out_data);
-    for (int i = 0; i < (sizeof(uint32_t) / sizeof(uint8_t)); i++) {
-      b[i] = read_bytes.front();
-      read_bytes.pop_front();
+  // rx_head only ever advances by whole words and the ring size is a
+  // multiple of 4, so a word never straddles the wrap point. Hand over the
+  // complete words in at most two runs.
+  while (rx_tail - rx_head >= sizeof(uint32_t)) {
+    size_t pos = rx_head & (rx_ring.size() - 1);
+    size_t nbytes = std::min((rx_tail - rx_head) & ~(sizeof(uint32_t) - 1), rx_ring.size() - pos);
+    const uint32_t* words = (const uint32_t*) &rx_ring[pos];
+    size_t nwords = nbytes / sizeof(uint32_t);
+    if (verbose) {
+      for (size_t i = 0; i < nwords; i++)
+        printf("Read %x\n", words[i]);
     }
-    if (verbose) printf("Read %x\n", out_data);
-    send_word(out_data);
+    if (trace.is_open())
+      trace.rx(words, nwords);
+    send_words(words, nwords);
+    rx_head += nbytes;
   }
   return data_available() || n > 0;
 }
 
+// Append one command to a link's send queue and note what it owes us back
+void testchip_uart_tsi_t::queue_command(size_t link, const uint32_t* cmd, size_t nwords, bool fence) {
+  uart_link_t &l = links[link];
+  const uint8_t* buf = (const uint8_t*) cmd;
+  l.tx.insert(l.tx.end(), buf, buf + nwords * sizeof(uint32_t));
+  if (verbose) {
+    for (size_t i = 0; i < nwords * sizeof(uint32_t); i++) {
+      printf("Wrote %x on link %ld\n", buf[i], link);
+    }
+  }
+
+  addr_t addr = cmd[1] | ((addr_t) cmd[2] << 32);
+  addr_t end = addr + ((addr_t) cmd[3] + 1) * sizeof(uint32_t);
+  if (cmd[0] == SAI_CMD_WRITE) {
+    l.dirty_start = l.dirty ? std::min(l.dirty_start, addr) : addr;
+    l.dirty_end = l.dirty ? std::max(l.dirty_end, end) : end;
+    l.dirty = true;
+  } else {
+    uart_reply_t reply = { link, (size_t) cmd[3] + 1, fence, addr, end };
+    expected_replies.push_back(reply);
+  }
+}
+
+// A link answers a read only after all of its earlier writes are done, so
+// reading back a word it wrote orders those writes before anything sent
+// after the reply
+void testchip_uart_tsi_t::fence_link(size_t link) {
+  addr_t addr = links[link].dirty_start;
+  uint32_t cmd[1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS] = {
+    SAI_CMD_READ, (uint32_t) addr, (uint32_t) (addr >> 32), 0, 0
+  };
+  queue_command(link, cmd, 1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS, true);
+  links[link].dirty = false;
+}
+
+// Fences every dirty link but except, and returns whether all fences have
+// come back
+bool testchip_uart_tsi_t::fence_links(size_t except) {
+  for (size_t i = 0; i < links.size(); i++) {
+    if (i != except && links[i].dirty)
+      fence_link(i);
+  }
+  return std::none_of(expected_replies.begin(), expected_replies.end(),
+                      [](const uart_reply_t &r) { return r.fence; });
+}
+
+// Whether cmd may go out on link now, without overtaking an earlier command
+// on another link that it depends on. Queues the fences it has to wait for.
+bool testchip_uart_tsi_t::link_ready(size_t link, const uint32_t* cmd) {
+  // A read waits for every other link's writes, whatever they covered, so
+  // that reads of device registers also see the writes before them
+  if (cmd[0] == SAI_CMD_READ)
+    return fence_links(link);
+
+  // A write waits for writes and reads of the same bytes that are still in
+  // flight on other links
+  addr_t addr = cmd[1] | ((addr_t) cmd[2] << 32);
+  addr_t end = addr + ((addr_t) cmd[3] + 1) * sizeof(uint32_t);
+  bool ready = true;
+  for (size_t i = 0; i < links.size(); i++) {
+    uart_link_t &l = links[i];
+    if (i != link && l.dirty && addr < l.dirty_end && l.dirty_start < end) {
+      fence_link(i);
+      ready = false;
+    }
+  }
+  for (auto &r : expected_replies) {
+    if (r.link != link && (r.fence || (addr < r.end && r.addr < end)))
+      ready = false;
+  }
+  return ready;
+}
+
+bool testchip_uart_tsi_t::handle_links() {
+  // Deal out tsi_t's queue a command at a time. tsi_t queues all words of a
+  // command at once, so only whole commands are ever seen here, though one
+  // may wrap around the end of its ring and is then copied out first. A
+  // command that could overtake one it depends on, on another link, is
+  // held back until that one is done.
+  size_t nwords = words_queued();
+  size_t pos = 0;
+  while (pos < nwords) {
+    const size_t header = 1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS;
+    const uint32_t* cmd;
+    size_t run = peek_words(&cmd);
+    if (run < header) {
+      cmd_buf.resize(header);
+      copy_words(0, header, cmd_buf.data());
+      cmd = cmd_buf.data();
+    }
+    size_t len = header;
+    if (cmd[0] == SAI_CMD_WRITE)
+      len += cmd[3] + 1;
+    if (run < len) {
+      cmd_buf.resize(len);
+      copy_words(0, len, cmd_buf.data());
+      cmd = cmd_buf.data();
+    }
+    addr_t addr = cmd[1] | ((addr_t) cmd[2] << 32);
+    size_t link = striping ? (addr / chunk_max_size()) % links.size() : 0;
+    if (!link_ready(link, cmd))
+      break;
+    queue_command(link, cmd, len, false);
+    if (trace.is_open())
+      trace.tx(cmd, len);
+    consume_words(len);
+    pos += len;
+  }
+
+  // Switching striping on or off orders everything before the switch
+  // before everything after it
+  if (stripe_switch && pos == nwords && fence_links(links.size()) && expected_replies.empty()) {
+    striping = stripe_next;
+    stripe_switch = false;
+  }
+
+  bool tx_pending = std::any_of(links.begin(), links.end(),
+                                [](const uart_link_t &l) { return l.tx_head < l.tx.size(); });
+  int timeout_ms = 0;
+  if (!expected_replies.empty() || tx_pending) {
+    idle_handoffs = 0;
+    timeout_ms = UART_REPLY_TIMEOUT_MS;
+  } else if (pos > 0) {
+    idle_handoffs = 0;
+  } else if (++idle_handoffs > 1 && !done()) {
+    timeout_ms = UART_IDLE_TIMEOUT_MS;
+  }
+
+  fd_set rfds, wfds;
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  int maxfd = 0;
+  for (auto &l : links) {
+    FD_SET(l.fd, &rfds);
+    if (l.tx_head < l.tx.size())
+      FD_SET(l.fd, &wfds);
+    maxfd = std::max(maxfd, l.fd);
+  }
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  auto wait_start = std::chrono::steady_clock::now();
+  int r = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+  if (r < 0 && errno != EINTR) {
+    uart_error("select failed with error %i: %s", errno, strerror(errno));
+  }
+  if (timeout_ms)
+    note_wait(wait_start, expected_replies.empty() && !tx_pending);
+
+  bool progress = false;
+  for (size_t i = 0; r > 0 && i < links.size(); i++) {
+    uart_link_t &l = links[i];
+    if (FD_ISSET(l.fd, &wfds)) {
+      ssize_t n = write(l.fd, &l.tx[l.tx_head], l.tx.size() - l.tx_head);
+      if (n < 0 && errno != EINTR && errno != EAGAIN) {
+        uart_error("write failed with error %i: %s", errno, strerror(errno));
+      }
+      if (n > 0) {
+        l.tx_head += n;
+        progress = true;
+      }
+      // A stall lasts from the first short write until the queue drains
+      bool stalled = l.tx_head < l.tx.size();
+      if (flow_control && stalled != l.stalled) {
+        auto now = std::chrono::steady_clock::now();
+        if (stalled) {
+          note_tx_stall(l.fd);
+          l.stalled_since = now;
+        } else {
+          tx_stall_time += std::chrono::duration<double>(now - l.stalled_since).count();
+        }
+        l.stalled = stalled;
+      }
+      if (l.tx_head == l.tx.size()) {
+        l.tx.clear();
+        l.tx_head = 0;
+      }
+    }
+    if (FD_ISSET(l.fd, &rfds)) {
+      uint8_t buf[4096];
+      ssize_t n = read(l.fd, buf, sizeof(buf));
+      if (n < 0 && errno != EINTR && errno != EAGAIN) {
+        uart_error("read failed with error %i: %s", errno, strerror(errno));
+      }
+      if (n > 0) {
+        l.rx.insert(l.rx.end(), buf, buf + n);
+        size_t whole = l.rx.size() & ~(sizeof(uint32_t) - 1);
+        for (size_t j = 0; j < whole; j += sizeof(uint32_t)) {
+          uint32_t word;
+          memcpy(&word, &l.rx[j], sizeof(word));
+          if (verbose) printf("Read %x on link %ld\n", word, i);
+          l.replies.push_back(word);
+        }
+        l.rx.erase(l.rx.begin(), l.rx.begin() + whole);
+        progress = true;
+      }
+    }
+  }
+
+  // Hand replies to tsi_t in the order their commands were issued
+  while (!expected_replies.empty()) {
+    uart_reply_t &head = expected_replies.front();
+    std::deque<uint32_t> &replies = links[head.link].replies;
+    for (; head.words && !replies.empty(); head.words--) {
+      if (!head.fence) {
+        if (trace.is_open())
+          trace_rx.push_back(replies.front());
+        send_word(replies.front());
+      }
+      replies.pop_front();
+    }
+    if (head.words)
+      break;
+    expected_replies.pop_front();
+  }
+  if (!trace_rx.empty()) {
+    trace.rx(trace_rx.data(), trace_rx.size());
+    trace_rx.clear();
+  }
+  return data_available() || progress || tx_pending;
+}
+
+bool testchip_uart_tsi_t::handle_replay() {
+  // Replies only depend on the commands, not on when they were sent, so
+  // a host that sends the same words sees the same run
+  const uint32_t* words;
+  size_t sent = 0;
+  while (size_t nwords = peek_words(&words)) {
+    for (size_t i = 0; i < nwords; i++, replay_tx++) {
+      if (replay_tx >= replay.tx.size()) {
+        uart_error("Replay sent TX word %ld (%x) past the end of the trace", replay_tx, words[i]);
+      }
+      if (words[i] != replay.tx[replay_tx]) {
+        uart_error("Replay diverged at TX word %ld: sent %x, trace has %x", replay_tx, words[i], replay.tx[replay_tx]);
+      }
+    }
+    consume_words(nwords);
+    sent += nwords;
+  }
+
+  size_t nreplies = std::min(reply_words_pending(), replay.rx.size() - replay_rx);
+  if (reply_words_pending() && !nreplies) {
+    uart_error("Trace ends with %ld reply words outstanding", reply_words_pending());
+  }
+  send_words(replay.rx.data() + replay_rx, nreplies);
+  replay_rx += nreplies;
+  return data_available() || sent > 0 || nreplies > 0;
+}
+
+// Called by the host between commands. Waits until the links have caught up
+// with everything queued so far before changing how commands are dealt out.
+void testchip_uart_tsi_t::set_striping(bool on) {
+  if (links.empty() || on == striping)
+    return;
+  stripe_next = on;
+  stripe_switch = true;
+  host_task_t::await([this] { return !stripe_switch; });
+}
+
+void testchip_uart_tsi_t::read_chunks(addr_t taddr, size_t nbytes, void* dst) {
+  if (links.empty() || nbytes <= chunk_max_size()) {
+    testchip_tsi_t::read_chunks(taddr, nbytes, dst);
+    return;
+  }
+  // Same as testchip_tsi_t::read_chunks without loadmem, which uart_tsi
+  // never has. Cache lines are flushed before striping, so that the switch
+  // orders them before the reads.
+  flush_cache_lines(taddr, nbytes);
+  set_striping(true);
+  tsi_t::read_chunks(taddr, nbytes, dst);
+  set_striping(false);
+}
+
 bool testchip_uart_tsi_t::check_connection() {
-  sleep(1); // sleep for 1 second
-  uint8_t rdata = 0;
-  int n = read(ttyfd, &rdata, 1);
-  if (n > 0) {
-    printf("Error: Reading unexpected data %c from UART. Abort.\n", rdata);
-    exit(1);
+  if (replaying)
+    return true;
+  std::vector<int> fds(1, ttyfd);
+  for (size_t i = 1; i < links.size(); i++)
+    fds.push_back(links[i].fd);
+  for (size_t i = 0; i < fds.size(); i++) {
+    double rtt = handshake(fds[i]);
+    if (rtt < 0) {
+      printf("Error: No reply to a read of %lx on link %ld\n", probe_addr, i);
+      return false;
+    }
+    printf("Link %ld: %.2f ms round trip\n", i, rtt * 1000);
   }
   return true;
 }
 
+double testchip_uart_tsi_t::handshake(int fd) {
+  // A one-word TSI read of a side-effect free address. Anything already
+  // waiting in RX is stale, e.g. left behind by an earlier run that was
+  // interrupted, so drop it first.
+  const uint32_t cmd[1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS] = {
+    SAI_CMD_READ, (uint32_t) probe_addr, (uint32_t) (probe_addr >> 32), 0, 0
+  };
+  int timeout_ms = UART_HANDSHAKE_TIMEOUT_MS;
+  for (int attempt = 0; attempt < UART_HANDSHAKE_ATTEMPTS; attempt++, timeout_ms *= 2) {
+    uint8_t stale[64];
+    tcflush(fd, TCIFLUSH);
+    while (wait_readable(fd, 0) && read(fd, stale, sizeof(stale)) > 0)
+      ;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t sent = 0; sent < sizeof(cmd); ) {
+      ssize_t n = write(fd, (const uint8_t*) cmd + sent, sizeof(cmd) - sent);
+      if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        uart_error("write failed with error %i: %s", errno, strerror(errno));
+      }
+      if (n < 0)
+        wait_writable(fd);
+      else
+        sent += n;
+    }
+    uint32_t reply;
+    size_t got = 0;
+    while (got < sizeof(reply) && wait_readable(fd, timeout_ms)) {
+      int n = read(fd, (uint8_t*) &reply + got, sizeof(reply) - got);
+      if (n <= 0)
+        break;
+      got += n;
+    }
+    std::chrono::duration<double> rtt = std::chrono::steady_clock::now() - start;
+    // After a retry the reply may belong to an earlier attempt, in which
+    // case this attempt's reply is still to come. Only a quiet line means
+    // the stream is in step.
+    if (got == sizeof(reply) && (attempt == 0 || !wait_readable(fd, timeout_ms)))
+      return rtt.count();
+    if (verbose)
+      printf("Handshake attempt %d: %ld bytes within %d ms\n", attempt, got, timeout_ms);
+  }
+  return -1;
+}
+
+void testchip_uart_tsi_t::calibrate_chunk_size() {
+  // Time a two-chunk read of DRAM at growing chunk sizes, and stop growing
+  // once a bigger chunk no longer buys a meaningful speedup. Smaller chunks
+  // cost less to redo after a bad transfer, so there is no point going past
+  // the knee of the curve.
+  size_t best_size = 0;
+  double best_rate = 0;
+  std::vector<uint8_t> buf;
+  for (size_t size : calib_chunk_sizes) {
+    set_chunk_max_size(size);
+    buf.resize(2 * size);
+    auto start = std::chrono::steady_clock::now();
+    read_chunks(DRAM_BASE, buf.size(), buf.data());
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    double rate = buf.size() / secs.count();
+    printf("Chunk size %ld: %.0f bytes/s\n", size, rate);
+    if (rate < best_rate * UART_CALIB_MIN_GAIN)
+      break;
+    best_size = size;
+    best_rate = rate;
+  }
+  set_chunk_max_size(best_size);
+  printf("Using chunk size %ld\n", best_size);
+}
+
+// Coalesce the chunks recorded during load into contiguous extents
+testchip_uart_tsi_t::extent_list_t testchip_uart_tsi_t::program_extents() {
+  extent_list_t extents;
+  for (auto &it : loaded_program) {
+    if (!extents.empty() && extents.back().first + extents.back().second.size() == it.first) {
+      extents.back().second.insert(extents.back().second.end(), it.second.begin(), it.second.end());
+    } else {
+      extents.push_back(it);
+    }
+  }
+  return extents;
+}
+
+void testchip_uart_tsi_t::load_compressed(const extent_list_t &extents) {
+  if (extents.empty())
+    return;
+
+  if (!start_stub()) {
+    printf("Warning: Target stub unavailable, loading uncompressed\n");
+    for (auto &e : extents)
+      memif().write(e.first, e.second.size(), e.second.data());
+    return;
+  }
+
+  addr_t staging = stub.payload_base();
+  size_t raw_bytes = 0, sent_bytes = 0;
+  for (auto &e : extents) {
+    std::vector<uint8_t> blob = lz4_compress(e.second.data(), e.second.size());
+    raw_bytes += e.second.size();
+    if (!stub.running() || blob.size() >= e.second.size()) {
+      memif().write(e.first, e.second.size(), e.second.data());
+      sent_bytes += e.second.size();
+      continue;
+    }
+    size_t blob_len = blob.size();
+    blob.resize((blob_len + chunk_align() - 1) & ~(chunk_align() - 1), 0);
+    memif().write(staging, blob.size(), blob.data());
+    sent_bytes += blob.size();
+    uint64_t n;
+    if (!stub.call(STUB_CMD_LZ4, staging, blob_len, e.first, &n)) {
+      printf("Warning: Target stub stopped responding, loading the rest uncompressed\n");
+      memif().write(e.first, e.second.size(), e.second.data());
+      sent_bytes += e.second.size();
+      continue;
+    }
+    if (n != e.second.size()) {
+      uart_error("Decompressing %lx to %lx produced %ld bytes, expected %ld",
+                 e.first, e.first + e.second.size(), n, e.second.size());
+    }
+  }
+  printf("Compressed load: sent %ld bytes for %ld bytes of program\n", sent_bytes, raw_bytes);
+}
+
+// One cache per tty, under ~/.cache/uart_tsi
+std::string testchip_uart_tsi_t::default_image_cache_path(const char* ttyfile) {
+  const char* home = getenv("HOME");
+  std::string dir = std::string(home ? home : "/tmp") + "/.cache";
+  mkdir(dir.c_str(), 0755);
+  dir += "/uart_tsi";
+  mkdir(dir.c_str(), 0755);
+  std::string name(ttyfile);
+  std::replace(name.begin(), name.end(), '/', '_');
+  return dir + "/" + name;
+}
+
+// Returns addr -> (len, crc32) of every extent from the last completed load
+std::map<addr_t, std::pair<size_t, uint32_t>> testchip_uart_tsi_t::read_image_cache() {
+  std::map<addr_t, std::pair<size_t, uint32_t>> cache;
+  FILE* f = fopen(image_cache_path.c_str(), "r");
+  if (!f)
+    return cache;
+  unsigned long addr, len, crc;
+  int n;
+  while ((n = fscanf(f, "%lx %lx %lx", &addr, &len, &crc)) == 3)
+    cache[addr] = std::make_pair(len, crc);
+  if (n != EOF)
+    cache.clear();
+  fclose(f);
+  return cache;
+}
+
+void testchip_uart_tsi_t::write_image_cache(const extent_list_t &extents) {
+  FILE* f = fopen(image_cache_path.c_str(), "w");
+  if (!f) {
+    printf("Warning: Could not write image cache %s: %s\n", image_cache_path.c_str(), strerror(errno));
+    return;
+  }
+  for (auto &e : extents)
+    fprintf(f, "%lx %lx %08x\n", e.first, e.second.size(), crc32_checksum(e.second.data(), e.second.size()));
+  fclose(f);
+}
+
+// Drop the extents that the target still holds from the previous load. An
+// extent is only skipped if both the host copy and the target memory still
+// hash to what was loaded last time; without the stub nothing is skipped.
+testchip_uart_tsi_t::extent_list_t testchip_uart_tsi_t::skip_cached_extents(const extent_list_t &extents) {
+  auto cache = read_image_cache();
+  // The cache is only valid again once this load completes
+  unlink(image_cache_path.c_str());
+  if (cache.empty())
+    return extents;
+  if (!start_stub()) {
+    printf("Warning: Target stub unavailable, ignoring image cache\n");
+    return extents;
+  }
+
+  extent_list_t changed;
+  size_t skipped = 0, total = 0;
+  for (auto &e : extents) {
+    total += e.second.size();
+    auto it = cache.find(e.first);
+    uint32_t crc = crc32_checksum(e.second.data(), e.second.size());
+    if (it == cache.end() || it->second.first != e.second.size() || it->second.second != crc) {
+      changed.push_back(e);
+      continue;
+    }
+    // The program may have written to it, or the board was reset
+    uint64_t target_crc;
+    if (!stub.call(STUB_CMD_CRC32, e.first, e.second.size(), 0, &target_crc) || target_crc != crc) {
+      changed.push_back(e);
+      continue;
+    }
+    skipped += e.second.size();
+  }
+  printf("Image cache: skipped %ld of %ld bytes\n", skipped, total);
+  return changed;
+}
+
+// Send the image held back by write_chunk during load
+void testchip_uart_tsi_t::upload_program() {
+  auto extents = program_extents();
+  if (!image_cache_path.empty()) {
+    // Split extents so a small change doesn't resend a whole segment
+    extent_list_t pieces;
+    for (auto &e : extents) {
+      for (size_t off = 0; off < e.second.size(); off += UART_IMAGE_CACHE_EXTENT) {
+        size_t len = std::min<size_t>(UART_IMAGE_CACHE_EXTENT, e.second.size() - off);
+        pieces.push_back(std::make_pair(e.first + off, std::vector<uint8_t>(e.second.begin() + off, e.second.begin() + off + len)));
+      }
+    }
+    extents.swap(pieces);
+  }
+
+  auto to_send = image_cache_path.empty() ? extents : skip_cached_extents(extents);
+  if (do_compress_load) {
+    load_compressed(to_send);
+  } else {
+    set_striping(true);
+    for (auto &e : to_send)
+      memif().write(e.first, e.second.size(), e.second.data());
+    set_striping(false);
+  }
+
+  if (!image_cache_path.empty())
+    write_image_cache(extents);
+}
+
 void testchip_uart_tsi_t::load_program() {
+  auto start = std::chrono::steady_clock::now();
+  if (reset_before_load)
+    perform_init_accesses();
+  if (do_calibrate_chunk)
+    calibrate_chunk_size();
+
+  // Loaded sections don't depend on each other, so stripe them unless they
+  // are held back for upload_program
   in_load_program = true;
-  testchip_tsi_t::load_program();
+  set_striping(!hold_load());
+  load_image();
+  set_striping(false);
   in_load_program = false;
+  flush_deferred_clears();
+
+  if (hold_load())
+    upload_program();
 
-  uint8_t rbuf[chunk_max_size()];
   if (do_self_check) {
     printf("Performing self check\n");
-    for (auto &it : loaded_program) {
-      addr_t addr = it.first;
-      printf("Self check chunk %lx to %lx\n", addr, addr + it.second.size());
-      read_chunk(addr, it.second.size(), rbuf);
-      for (size_t i = 0; i < it.second.size(); i++) {
-	if (rbuf[i] != it.second[i]) {
-	  printf("Self check failed at address %lx %x != %x\n", addr + i, rbuf[i], it.second[i]);
-	  exit(1);
-	}
+    if (do_full_self_check || !start_stub())
+      self_check_readback(0, (addr_t)-1);
+    else
+      self_check_crc();
+    printf("Self check success\n");
+  }
+  load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Read back every loaded extent in [start, end) and compare byte by byte.
+// Whole extents go through read_chunks, so the reads are pipelined.
+void testchip_uart_tsi_t::self_check_readback(addr_t start, addr_t end) {
+  std::vector<uint8_t> rbuf;
+  for (auto &e : program_extents()) {
+    addr_t addr = e.first;
+    if (addr < start || addr >= end)
+      continue;
+    printf("Self check extent %lx to %lx\n", addr, addr + e.second.size());
+    rbuf.resize(e.second.size());
+    read_chunks(addr, rbuf.size(), rbuf.data());
+    for (size_t i = 0; i < rbuf.size(); i++) {
+      if (rbuf[i] != e.second[i]) {
+	uart_error("Self check failed at address %lx %x != %x", addr + i, rbuf[i], e.second[i]);
       }
-      printf("Self check succeeded chunk %lx to %lx\n", addr, addr + it.second.size());
     }
-    printf("Self check success\n");
+    printf("Self check succeeded extent %lx to %lx\n", addr, addr + e.second.size());
+  }
+}
+
+// Have the target stub checksum each extent, and only read back the ones
+// that don't match to find the failing address
+void testchip_uart_tsi_t::self_check_crc() {
+  for (auto &e : program_extents()) {
+    addr_t addr = e.first;
+    size_t len = e.second.size();
+    uint32_t expected = crc32_checksum(e.second.data(), len);
+    uint64_t actual;
+    if (!stub.call(STUB_CMD_CRC32, addr, len, 0, &actual)) {
+      // The stub gave up, compare this extent the slow way
+      self_check_readback(addr, addr + len);
+      continue;
+    }
+    if (actual == expected) {
+      printf("Self check succeeded extent %lx to %lx (crc32 %08x)\n", addr, addr + len, (uint32_t)actual);
+      continue;
+    }
+    printf("Self check crc32 mismatch in extent %lx to %lx %08x != %08x\n", addr, addr + len, (uint32_t)actual, expected);
+    self_check_readback(addr, addr + len);
+    uart_error("Self check failed in extent %lx to %lx, but readback matched", addr, addr + len);
   }
 }
 
 void testchip_uart_tsi_t::write_chunk(addr_t taddr, size_t nbytes, const void* src) {
-  testchip_tsi_t::write_chunk(taddr, nbytes, src);
+  // When holding back the image, upload_program sends it after load
+  if (!(in_load_program && hold_load())) {
+    testchip_tsi_t::write_chunk(taddr, nbytes, src);
+  } else {
+    load_end = std::max(load_end, taddr + nbytes);
+    // An earlier clear of this range must not run over the held data, which
+    // the image cache may even skip uploading
+    drop_deferred_clears(taddr, nbytes);
+  }
   if (in_load_program) {
     for (auto &it : loaded_program) {
       addr_t eaddr = taddr + nbytes;
       if ((taddr >= it.first && taddr  < (it.first + it.second.size())) ||
 	  (eaddr  > it.first && eaddr <= (it.first + it.second.size())) ||
 	  (taddr  < it.first && eaddr  > (it.first + it.second.size()))) {
-	printf("Error: Overlapping sections in loaded program.\n");
-	printf("Write addr: %lx - %lx\n", taddr, eaddr);
-	printf("Conflict addr: %lx - %lx\n", it.first, it.first + it.second.size());
-	exit(1);
+	uart_error("Overlapping sections in loaded program, write %lx - %lx conflicts with %lx - %lx",
+		   taddr, eaddr, it.first, it.first + it.second.size());
       }
     }
     loaded_program[taddr] = std::vector<uint8_t>((const uint8_t*)src, ((const uint8_t*)src) + nbytes);
   }
 }
 
-int main(int argc, char* argv[]) {
-  printf("Starting UART-based TSI\n");
-  printf("Usage: ./uart_tsi +tty=/dev/pts/xx <PLUSARGS> <bin>\n");
-  printf("       ./uart_tsi +tty=/dev/ttyxx  <PLUSARGS> <bin>\n");
-  printf("       ./uart_tsi +tty=/dev/ttyxx  +no_hart0_msip +init_write=0x80000000:0xdeadbeef none\n");
-  printf("       ./uart_tsi +tty=/dev/ttyxx  +no_hart0_msip +init_read=0x80000000 none\n");
-  printf("       ./uart_tsi +tty=/dev/ttyxx  +selfcheck <bin>\n");
-  printf("       ./uart_tsi +tty=/dev/ttyxx  +baudrate=921600 <bin>\n");
-  printf("Hint:  Use /dev/cu.xxx if using macOS, /dev/tty.xxx if using linux.\n");
-
-  // Add the permissive flags in manually here
-  std::vector<std::string> args;
-  for (int i = 0; i < argc; i++) {
-    bool is_plusarg = argv[i][0] == '+';
-    if (is_plusarg) {
-      args.push_back("+permissive");
-      args.push_back(std::string(argv[i]));
-      args.push_back("+permissive-off");
-    } else {
-      args.push_back(std::string(argv[i]));
-    }
+void testchip_uart_tsi_t::clear_chunk(addr_t taddr, size_t nbytes) {
+  if (!(in_load_program && hold_load())) {
+    testchip_tsi_t::clear_chunk(taddr, nbytes);
+    return;
   }
-
-  std::string tty;
-  bool verbose = false;
-  bool self_check = false;
-  uint64_t baud_rate = 115200;
-  for (std::string& arg : args) {
-    if (arg.find("+tty=") == 0) {
-      tty = std::string(arg.c_str() + 5);
-    }
-    if (arg.find("+verbose") == 0) {
-      verbose = true;
-    }
-    if (arg.find("+selfcheck") == 0) {
-      self_check = true;
-    }
-    if (arg.find("+baudrate=") == 0) {
-      baud_rate = strtoull(arg.substr(10).c_str(), 0, 10);
-    }
-  }
-
-  if (tty.size() == 0) {
-    printf("ERROR: Must use +tty=/dev/ttyxx to specify a tty\n");
-    exit(1);
+  // The held image is uploaded after the clears, so a clear that comes after
+  // held data has to zero it in the held copy to keep program order. Only
+  // the rest of the range is cleared on the target.
+  std::vector<std::pair<addr_t, size_t>> gaps;
+  addr_t end = taddr + nbytes;
+  addr_t next = taddr;
+  for (auto &it : loaded_program) {
+    addr_t held_end = it.first + it.second.size();
+    if (held_end <= next || it.first >= end)
+      continue;
+    if (it.first > next)
+      gaps.push_back(std::make_pair(next, it.first - next));
+    addr_t from = std::max(next, it.first);
+    addr_t to = std::min(end, held_end);
+    std::fill(it.second.begin() + (from - it.first), it.second.begin() + (to - it.first), 0);
+    next = to;
   }
-
-  printf("Attempting to open TTY at %s\n", tty.c_str());
-  std::vector<std::string> tsi_args(args);
-  char* tsi_argv[args.size()];
-  for (int i = 0; i < args.size(); i++)
-    tsi_argv[i] = tsi_args[i].data();
-
-  testchip_uart_tsi_t tsi(args.size(), tsi_argv,
-			  tty.data(), baud_rate,
-			  verbose, self_check);
-  printf("Checking connection status with %s\n", tty.c_str());
-  if (!tsi.check_connection()) {
-    printf("Connection failed\n");
-    exit(1);
-  } else {
-    printf("Connection succeeded\n");
-  }
-  while (!tsi.done()) {
-    tsi.switch_to_host();
-    tsi.handle_uart();
-  }
-  printf("Done, shutting down, flushing UART\n");
-  while (tsi.handle_uart()) {
-    tsi.switch_to_host();
-  }; // flush any inflight reads or writes
-  printf("WARNING: You should probably reset the target before running this program again\n");
-  return tsi.exit_code();
+  if (next < end)
+    gaps.push_back(std::make_pair(next, end - next));
+  for (auto &gap : gaps)
+    testchip_tsi_t::clear_chunk(gap.first, gap.second);
 }
@@ -1,9 +1,14 @@
 #ifndef __TESTCHIP_UART_TSI_H
 #include "testchip_tsi.h"
+#include "uart_trace.h"
+#include <deque>
+#include <chrono>
 
 class testchip_uart_tsi_t : public testchip_tsi_t
 {
 public:
+  // A baud_rate of 0 probes for the rate the target is running at. tty may
+  // list several comma-separated links into the same target, see links.
   testchip_uart_tsi_t(int argc, char** argv, char* tty,
 		      uint64_t baud_rate,
 		      bool verbose, bool do_self_check);
@@ -11,15 +16,134 @@ public:
 
   bool handle_uart();
   bool check_connection();
+  void print_flow_control_stats();
+  // Final stats line, and the JSON report for +stats=<file>
+  void report_stats();
   void load_program() override;
+  // Also run the +init_write=/+init_read= accesses before loading, so that
+  // a daemon's target is reset from the last job before the next one lands
+  void set_reset_before_load(bool enable) { reset_before_load = enable; }
   void write_chunk(addr_t taddr, size_t nbytes, const void* src) override;
+  void clear_chunk(addr_t taddr, size_t nbytes) override;
+  void read_chunks(addr_t taddr, size_t nbytes, void* dst) override;
 
 private:
+  // tests/uart_tsi_test.cc drives the links and the tty directly
+  friend struct uart_tsi_test;
+
+  // Contiguous runs of the loaded image, as (address, bytes)
+  typedef std::vector<std::pair<addr_t, std::vector<uint8_t>>> extent_list_t;
+
+  static int open_tty(const char* ttyfile);
+  static void configure_tty(int fd);
+  static bool set_baud_rate(int fd, uint64_t baud_rate);
+  static bool set_flow_control(int fd);
+  void note_tx_stall(int fd);
+  uint64_t auto_baud_rate();
+  bool probe_link(uint64_t baud_rate);
+  void calibrate_chunk_size();
+  void load_compressed(const extent_list_t &extents);
+  bool hold_load() { return do_compress_load || !image_cache_path.empty(); }
+  void upload_program();
+  static std::string default_image_cache_path(const char* ttyfile);
+  std::map<addr_t, std::pair<size_t, uint32_t>> read_image_cache();
+  void write_image_cache(const extent_list_t &extents);
+  extent_list_t skip_cached_extents(const extent_list_t &extents);
+  extent_list_t program_extents();
+  void self_check_readback(addr_t start, addr_t end);
+  void self_check_crc();
+  // Seconds for a read of probe_addr to come back on fd, negative if none did
+  double handshake(int fd);
+  bool wait_readable(int fd, int timeout_ms);
+  void wait_writable(int fd);
+  void write_bytes(const uint8_t* buf, size_t len);
+  bool handle_links();
+  bool handle_replay();
+  void note_wait(std::chrono::steady_clock::time_point start, bool idle);
+  void print_stats_line(bool final);
+  void write_stats_json();
+  void queue_command(size_t link, const uint32_t* cmd, size_t nwords, bool fence);
+  void fence_link(size_t link);
+  bool fence_links(size_t except);
+  bool link_ready(size_t link, const uint32_t* cmd);
+  void set_striping(bool on);
+
   int ttyfd;
-  std::deque<uint8_t> read_bytes;
   bool verbose;
   bool in_load_program;
+  bool reset_before_load;
   bool do_self_check;
+  int idle_handoffs;
+  uint64_t probe_addr;
+  bool do_calibrate_chunk;
+  bool do_compress_load;
+  bool do_full_self_check;
+  // Per-extent hashes of the last completed load, empty if disabled
+  std::string image_cache_path;
+
+  // Fixed-capacity RX byte ring, indices run free and are masked on access
+  std::vector<uint8_t> rx_ring;
+  size_t rx_head;
+  size_t rx_tail;
+
+  // Bonded links, for +tty=<tty0>,<tty1>,... Each is a separate TSI bridge
+  // into the same target that answers its own commands in order. Link 0 is
+  // ttyfd and carries everything outside of striped bulk transfers, where
+  // commands go out on all links by address. Empty with a single tty.
+  struct uart_link_t {
+    int fd;
+    std::vector<uint8_t> tx; // bytes not yet accepted by the tty
+    size_t tx_head;
+    std::vector<uint8_t> rx; // a partial reply word
+    std::deque<uint32_t> replies; // complete words, not yet reassembled
+    bool dirty; // has writes that no later read has fenced
+    addr_t dirty_start, dirty_end; // covers all of those writes
+    bool stalled; // for +flowctl=rts
+    std::chrono::steady_clock::time_point stalled_since;
+  };
+  // Reply words owed by the links, in the order tsi_t expects them
+  struct uart_reply_t {
+    size_t link;
+    size_t words;
+    bool fence; // dropped rather than passed on
+    addr_t addr, end; // bytes read
+  };
+  std::vector<uart_link_t> links;
+  std::vector<uint32_t> cmd_buf; // a command that wraps in tsi_t's ring
+  std::deque<uart_reply_t> expected_replies;
+  bool striping;
+  // Set by the host to switch striping to stripe_next, cleared by
+  // handle_links once all earlier commands have completed
+  bool stripe_switch;
+  bool stripe_next;
+
+  // +flowctl=rts: RTS/CTS on every link, writes stall instead of overrunning
+  // the bridge
+  bool flow_control;
+  uint64_t tx_stalls;
+  uint64_t tx_cts_stalls;
+  double tx_stall_time; // seconds
+
+  // +trace=<file> records the words exchanged with tsi_t. +replay=<file>
+  // stands in for the target: the words tsi_t sends must match the trace,
+  // and the recorded replies are handed back.
+  uart_trace_writer_t trace;
+  std::vector<uint32_t> trace_rx; // link replies collected for one RX record
+  bool replaying;
+  uart_trace_reader_t replay;
+  size_t replay_tx;
+  size_t replay_rx;
+
+  // +stats prints a line every UART_STATS_INTERVAL_S, +stats=<file> also
+  // writes a JSON report at the end
+  bool stats_enabled;
+  std::string stats_path;
+  std::chrono::steady_clock::time_point stats_start;
+  std::chrono::steady_clock::time_point stats_last;
+  tsi_stats_t stats_at_last; // for the rates since the last line
+  double load_time; // seconds in load_program, self check included
+  double reply_wait_time; // seconds asleep waiting for read replies
+  double idle_time; // seconds asleep with nothing in flight
 
   // Used for self-test
   std::map<uint64_t, std::vector<uint8_t>> loaded_program;
@@ -0,0 +1,220 @@
+#include <fesvr/context.h>
+#include <fenv.h>
+#include <stdint.h>
+#include "test.h"
+
+// Also built with -DCONTEXT_NO_FAST_SWITCH, against the ucontext fallback
+#ifdef CONTEXT_NO_FAST_SWITCH
+#define TEST_NAME "context_ucontext_test"
+#else
+#define TEST_NAME "context_test"
+#endif
+
+#if defined(__x86_64__)
+// Calls fn(arg) with seed + 1 to seed + 6 in rbx, rbp and r12-r15, and
+// returns how many of them came back changed
+extern "C" int call_checking_registers(void (*fn)(void*), void* arg, uint64_t seed);
+
+#define CHECK_REG(n, reg) \
+  "  leaq " #n "(%rdx), %rcx\n" \
+  "  cmpq %rcx, %" #reg "\n" \
+  "  setne %cl\n" \
+  "  movzbl %cl, %ecx\n" \
+  "  addl %ecx, %eax\n"
+asm(
+  ".text\n"
+  ".type call_checking_registers, @function\n"
+  "call_checking_registers:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  pushq %rdx\n" // the stack is 16-byte aligned again
+  "  movq %rdi, %rax\n"
+  "  movq %rsi, %rdi\n"
+  "  leaq 1(%rdx), %rbx\n"
+  "  leaq 2(%rdx), %rbp\n"
+  "  leaq 3(%rdx), %r12\n"
+  "  leaq 4(%rdx), %r13\n"
+  "  leaq 5(%rdx), %r14\n"
+  "  leaq 6(%rdx), %r15\n"
+  "  call *%rax\n"
+  "  movq (%rsp), %rdx\n"
+  "  xorl %eax, %eax\n"
+  CHECK_REG(1, rbx)
+  CHECK_REG(2, rbp)
+  CHECK_REG(3, r12)
+  CHECK_REG(4, r13)
+  CHECK_REG(5, r14)
+  CHECK_REG(6, r15)
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  ".size call_checking_registers, .-call_checking_registers\n"
+);
+#else
+// Elsewhere only the values the compiler keeps live across the switch
+// are checked, see ping()
+static int call_checking_registers(void (*fn)(void*), void* arg, uint64_t seed)
+{
+  fn(arg);
+  return 0;
+}
+#endif
+
+#define ROUNDS 1000
+
+// The rounding mode is in MXCSR and the x87 control word, which the ABI
+// asks callees to preserve. fegetround() reads the latter, a division in
+// SSE registers shows the former. aarch64 has nothing like it to check.
+static double third()
+{
+  volatile double one = 1, three = 3;
+  return one / three;
+}
+
+static bool rounding_kept(int rounding, double expect_third)
+{
+#if defined(__x86_64__)
+  return fegetround() == rounding && third() == expect_third;
+#else
+  return true;
+#endif
+}
+
+struct pingpong_t {
+  context_t* main;
+  context_t other;
+  int turn; // bumped by each side before it switches away
+  int bad_registers;
+  int bad_values;
+  int bad_rounding;
+  int bad_turns;
+};
+
+static void switch_to_main(void* arg) { static_cast<pingpong_t*>(arg)->main->switch_to(); }
+static void switch_to_other(void* arg) { static_cast<pingpong_t*>(arg)->other.switch_to(); }
+
+// One side of the game: switches away ROUNDS times through fn, checking
+// that its registers, live values and rounding mode come back each time
+static void ping(pingpong_t* p, void (*fn)(void*), uint64_t seed, int rounding, int first_turn)
+{
+  volatile double scale = seed;
+  double x = scale * 0.5, y = scale * 0.25;
+  uint64_t a = seed * 3, b = seed * 5, c = seed * 7;
+  fesetround(rounding);
+  double expect_third = third();
+  for (int i = 0; i < ROUNDS; i++) {
+    if (p->turn != first_turn + 2 * i)
+      p->bad_turns++;
+    p->turn++;
+    p->bad_registers += call_checking_registers(fn, p, seed + i);
+    if (x != scale * 0.5 || y != scale * 0.25 || a != seed * 3 || b != seed * 5 || c != seed * 7)
+      p->bad_values++;
+    if (!rounding_kept(rounding, expect_third))
+      p->bad_rounding++;
+    x += 1; y += 2; a++; b++; c++;
+    x -= 1; y -= 2; a--; b--; c--;
+  }
+}
+
+static void pong_thread(void* arg)
+{
+  pingpong_t* p = static_cast<pingpong_t*>(arg);
+  ping(p, switch_to_main, 0x2000000, FE_UPWARD, 1);
+  p->main->switch_to();
+}
+
+// The two contexts take turns, each keeping its own callee-saved registers
+// and floating-point control state
+static void test_ping_pong()
+{
+  pingpong_t p = {};
+  p.main = context_t::current();
+  p.other.init(pong_thread, &p);
+  ping(&p, switch_to_other, 0x1000000, FE_TOWARDZERO, 0);
+  CHECK(fegetround() == FE_TOWARDZERO);
+  fesetround(FE_TONEAREST);
+  // let it finish its last round
+  p.other.switch_to();
+
+  CHECK(p.turn == 2 * ROUNDS);
+  CHECK(p.bad_turns == 0);
+  CHECK(p.bad_registers == 0);
+  CHECK(p.bad_values == 0);
+  CHECK(p.bad_rounding == 0);
+}
+
+// The compiler places a 16-byte aligned local assuming the stack was
+// aligned as the ABI requires on entry, so the local is only really
+// aligned if it was. The empty asm keeps it from folding the check.
+static bool is_aligned(volatile void* local)
+{
+  uintptr_t addr = (uintptr_t)local;
+  asm volatile("" : "+r"(addr));
+  return (addr & 15) == 0;
+}
+
+__attribute__((noinline)) static bool entry_aligned()
+{
+  alignas(16) volatile char probe[16];
+  probe[0] = 0;
+  return is_aligned(probe);
+}
+
+struct aligned_t {
+  context_t* main;
+  bool entry;
+  bool nested;
+};
+
+static void aligned_thread(void* arg)
+{
+  aligned_t* a = static_cast<aligned_t*>(arg);
+  alignas(16) volatile char probe[16];
+  probe[0] = 0;
+  a->entry = is_aligned(probe);
+  a->nested = entry_aligned();
+  a->main->switch_to();
+}
+
+static void test_stack_alignment()
+{
+  CHECK(entry_aligned());
+  // odd stack sizes included, the top of the stack is aligned all the same
+  size_t sizes[] = { 0, 10000, 65536 + 8, 65536 + 4 };
+  for (size_t size : sizes) {
+    aligned_t a = { context_t::current(), false, false };
+    context_t ctx;
+    ctx.init(aligned_thread, &a, size);
+    ctx.switch_to();
+    CHECK(a.entry);
+    CHECK(a.nested);
+  }
+}
+
+int main()
+{
+#ifdef USE_FAST_CONTEXT
+  bool fast_switch = true;
+#else
+  bool fast_switch = false;
+#endif
+  // ucontext when asked for, or under CET shadow stacks
+#if defined(CONTEXT_NO_FAST_SWITCH) || (defined(__CET__) && (__CET__ & 2)) || defined(__SHSTK__)
+  CHECK(!fast_switch);
+#elif (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+  CHECK(fast_switch);
+#endif
+  test_ping_pong();
+  test_stack_alignment();
+
+  return test_result(TEST_NAME);
+}
@@ -0,0 +1,233 @@
+#include <fesvr/memif.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "test.h"
+
+#define MEM_BYTES (1 << 16)
+#define FILL 0xaa
+
+// Target memory on the host, recording which accesses reached it
+class fake_memif_t : public chunked_memif_t
+{
+ public:
+  fake_memif_t(size_t align = 4) : mem(MEM_BYTES, FILL), align(align), writes(0), transfers(0) {}
+
+  void read_chunk(addr_t taddr, size_t len, void* dst)
+  {
+    check_chunk(taddr, len);
+    CHECK(len <= chunk_max_size());
+    memcpy(dst, &mem[taddr], len);
+  }
+
+  void write_chunk(addr_t taddr, size_t len, const void* src)
+  {
+    check_chunk(taddr, len);
+    CHECK(len <= chunk_max_size());
+    memcpy(&mem[taddr], src, len);
+    writes++;
+  }
+
+  void clear_chunk(addr_t taddr, size_t len)
+  {
+    check_chunk(taddr, len);
+    memset(&mem[taddr], 0, len);
+    clears.push_back(std::make_pair(taddr, len));
+  }
+
+  void transfer_chunks(const std::vector<chunk_op_t>& ops)
+  {
+    transfers++;
+    chunked_memif_t::transfer_chunks(ops);
+  }
+
+  size_t chunk_align() { return align; }
+  size_t chunk_max_size() { return 1024; }
+
+  std::vector<uint8_t> mem;
+  size_t align;
+  size_t writes;
+  size_t transfers;
+  std::vector<std::pair<addr_t, size_t>> clears;
+
+ private:
+  // clears may span several chunks
+  void check_chunk(addr_t taddr, size_t len)
+  {
+    CHECK(taddr % align == 0 && len % align == 0);
+    CHECK(taddr + len <= mem.size());
+  }
+};
+
+// Runs of at least zero_run_min are cleared, shorter ones are written
+static void test_zero_runs()
+{
+  fake_memif_t target;
+  memif_t memif(&target);
+  memif.set_zero_run_min(256);
+
+  // data, 512 zero bytes, data, 128 zero bytes, data
+  std::vector<uint8_t> buf(1024 + 512 + 1024 + 128 + 64, 1);
+  memset(&buf[1024], 0, 512);
+  memset(&buf[2560], 0, 128);
+  memif.write(0x1000, buf.size(), buf.data());
+
+  CHECK(target.clears.size() == 1);
+  CHECK(target.clears[0] == std::make_pair((addr_t)0x1400, (size_t)512));
+  CHECK(memcmp(&target.mem[0x1000], buf.data(), buf.size()) == 0);
+}
+
+// A write that is zero throughout is one clear, whatever its length
+static void test_all_zero()
+{
+  fake_memif_t target;
+  memif_t memif(&target);
+
+  std::vector<uint8_t> zeros(192, 0);
+  memif.write(0x2000, zeros.size(), zeros.data());
+  CHECK(target.clears.size() == 1);
+  CHECK(target.clears[0] == std::make_pair((addr_t)0x2000, (size_t)192));
+  CHECK(target.writes == 0);
+  CHECK(target.mem[0x2000 + 191] == 0 && target.mem[0x2000 + 192] == FILL);
+}
+
+static void test_splitting_off()
+{
+  fake_memif_t target;
+  memif_t memif(&target);
+  memif.set_zero_run_min(~(size_t)0);
+
+  std::vector<uint8_t> buf(8192, 0);
+  buf[0] = 1;
+  memif.write(0, buf.size(), buf.data());
+  CHECK(target.clears.empty());
+  CHECK(target.writes == 8);
+  CHECK(memcmp(&target.mem[0], buf.data(), buf.size()) == 0);
+}
+
+// Unaligned writes with scattered zero runs land exactly where they should
+static void test_random_writes()
+{
+  srand(1);
+  for (int t = 0; t < 500; t++) {
+    fake_memif_t target((size_t)1 << (rand() % 4));
+    memif_t memif(&target);
+    if (t % 3 == 0)
+      memif.set_zero_run_min(rand() % 300);
+
+    size_t len = rand() % 20000, addr = 1 + rand() % 5000;
+    std::vector<uint8_t> buf(len, 0);
+    for (int runs = rand() % 6; runs > 0; runs--) {
+      size_t start = rand() % (len + 1), n = rand() % 300;
+      for (size_t i = start; i < std::min(len, start + n); i++)
+        buf[i] = rand() % 3 ? rand() : 0;
+    }
+    memif.write(addr, len, buf.data());
+
+    CHECK(memcmp(&target.mem[addr], buf.data(), len) == 0);
+    CHECK(target.mem[addr - 1] == FILL && target.mem[addr + len] == FILL);
+  }
+}
+
+// A batch leaves memory and read results as the same accesses one by one
+static void test_batches()
+{
+  srand(2);
+  for (int t = 0; t < 1000; t++) {
+    size_t align = (size_t)1 << (rand() % 4);
+    fake_memif_t batched(align), sequential(align);
+    memif_t batched_memif(&batched), sequential_memif(&sequential);
+    for (size_t i = 0; i < MEM_BYTES; i++)
+      batched.mem[i] = sequential.mem[i] = rand();
+    if (t & 1) {
+      size_t zero_run_min = rand() % 200;
+      batched_memif.set_zero_run_min(zero_run_min);
+      sequential_memif.set_zero_run_min(zero_run_min);
+    }
+
+    memif_batch_t batch = batched_memif.batch();
+    int nops = rand() % 8;
+    std::vector<std::vector<uint8_t>> batched_reads(nops), sequential_reads(nops);
+    for (int i = 0; i < nops; i++) {
+      size_t addr = rand() % 2000, len = rand() % 300;
+      if (rand() % 2) {
+        std::vector<uint8_t> data(len);
+        for (auto& byte : data)
+          byte = rand() % 4 ? rand() : 0;
+        if (rand() % 3 == 0)
+          std::fill(data.begin(), data.end(), 0);
+        batch.write(addr, len, data.data());
+        sequential_memif.write(addr, len, data.data());
+      } else {
+        batched_reads[i].resize(len);
+        sequential_reads[i].resize(len);
+        batch.read(addr, len, batched_reads[i].data());
+        sequential_memif.read(addr, len, sequential_reads[i].data());
+      }
+    }
+    batch.submit();
+
+    CHECK(batched.mem == sequential.mem);
+    CHECK(batched_reads == sequential_reads);
+  }
+}
+
+// Aligned accesses of a batch reach the transport as one transfer
+static void test_batch_transfer()
+{
+  fake_memif_t target;
+  memif_t memif(&target);
+  uint32_t a, b, c = 0x12345678;
+
+  memif_batch_t batch = memif.batch();
+  batch.read(0x100, 4, &a);
+  batch.write(0x104, 4, &c);
+  batch.read(0x104, 4, &b);
+  batch.submit();
+
+  CHECK(target.transfers == 1);
+  CHECK(a == 0xaaaaaaaa);
+  CHECK(b == c);
+}
+
+// patch() leaves the shadow in place, a plain write drops it
+static void test_patch_keeps_shadow()
+{
+  fake_memif_t target;
+  memif_t memif(&target);
+  memif.set_shadowing(true);
+
+  uint32_t image[4] = { 1, 2, 3, 4 };
+  memif.write(0x800, sizeof(image), image);
+  memif.shadow(0x800, sizeof(image), image);
+
+  // a short-lived patch, put back before anything reads it
+  uint32_t trampoline = 0xdeadbeef;
+  memif.patch(0x800, sizeof(trampoline), &trampoline);
+  CHECK(memcmp(&target.mem[0x800], &trampoline, sizeof(trampoline)) == 0);
+  memif.patch(0x800, sizeof(image[0]), &image[0]);
+
+  // reads are served from the shadow, not the target
+  memset(&target.mem[0x800], 0, sizeof(image));
+  uint64_t nread = memif.bytes_read();
+  CHECK(memif.read_uint32(0x804) == 2);
+  CHECK(memif.bytes_read() == nread);
+
+  memif.write_uint32(0x808, 9);
+  CHECK(memif.read_uint32(0x804) == 0);
+  CHECK(memif.read_uint32(0x808) == 9);
+  CHECK(memif.bytes_read() == nread + 8);
+}
+
+int main()
+{
+  test_zero_runs();
+  test_all_zero();
+  test_splitting_off();
+  test_random_writes();
+  test_batches();
+  test_batch_transfer();
+  test_patch_keeps_shadow();
+
+  return test_result("memif_test");
+}
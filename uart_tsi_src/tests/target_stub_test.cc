@@ -0,0 +1,228 @@
+#include "target_stub.h"
+#include <fesvr/encoding.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include "test.h"
+
+// As laid out by target_stub.cc
+#define CLINT_MSIP_BASE 0x2000000
+#define STUB_READY  0x00
+#define STUB_CMD    0x08
+#define STUB_ARG0   0x10
+#define STUB_RESULT 0x28
+#define STUB_CODE   0x40
+
+#define SCRATCH (DRAM_BASE + 0x100000)
+#define PROGRAM_ENTRY 0x00000297 // auipc t0, 0
+
+// Sparse target memory that plays hart 0 and the monitor: on its MSIP
+// hart 0 follows whatever DRAM_BASE jumps to, and the monitor finishes a
+// command the first time the host polls it
+class fake_target_t : public chunked_memif_t
+{
+ public:
+  fake_target_t() : checks_in(true), monitor_answers(true), jump_target(0), msip_writes(0) {}
+
+  void read_chunk(addr_t taddr, size_t len, void* dst)
+  {
+    if (taddr == SCRATCH + STUB_CMD && monitor_answers && load64(taddr)) {
+      uint64_t args[3];
+      for (int i = 0; i < 3; i++)
+        args[i] = load64(SCRATCH + STUB_ARG0 + 8 * i);
+      store64(SCRATCH + STUB_RESULT, load64(taddr) + args[0] + args[1] + args[2]);
+      store64(taddr, 0);
+    }
+    for (size_t i = 0; i < len; i++)
+      ((uint8_t*)dst)[i] = byte(taddr + i);
+  }
+
+  void write_chunk(addr_t taddr, size_t len, const void* src)
+  {
+    for (size_t i = 0; i < len; i++)
+      byte(taddr + i) = ((const uint8_t*)src)[i];
+    if (taddr == CLINT_MSIP_BASE && byte(taddr) == 1) {
+      msip_writes++;
+      jump_target = decode_jump(DRAM_BASE);
+      if (checks_in && jump_target == SCRATCH + STUB_CODE)
+        store64(SCRATCH + STUB_READY, 1);
+    }
+  }
+
+  void clear_chunk(addr_t taddr, size_t len)
+  {
+    for (size_t i = 0; i < len; i++)
+      byte(taddr + i) = 0;
+  }
+
+  size_t chunk_align() { return 4; }
+  size_t chunk_max_size() { return 1024; }
+
+  uint32_t load32(addr_t addr)
+  {
+    uint32_t val = 0;
+    for (int i = 3; i >= 0; i--)
+      val = val << 8 | byte(addr + i);
+    return val;
+  }
+
+  uint64_t load64(addr_t addr) { return load32(addr) | (uint64_t)load32(addr + 4) << 32; }
+
+  void store64(addr_t addr, uint64_t val)
+  {
+    for (int i = 0; i < 8; i++)
+      byte(addr + i) = val >> (8 * i);
+  }
+
+  bool checks_in;
+  bool monitor_answers;
+  addr_t jump_target; // where DRAM_BASE sent hart 0 on the last MSIP
+  int msip_writes;
+
+ private:
+  std::map<addr_t, uint8_t> mem;
+
+  uint8_t& byte(addr_t addr) { return mem[addr]; }
+
+  // auipc t0, hi; jalr zero, lo(t0), or 0 if that isn't what's there
+  addr_t decode_jump(addr_t pc)
+  {
+    uint32_t auipc = load32(pc), jalr = load32(pc + 4);
+    if ((auipc & 0xfff) != 0x297 || (jalr & 0xfffff) != 0x28067)
+      return 0;
+    return pc + (int64_t)(int32_t)(auipc & 0xfffff000) + ((int32_t)jalr >> 20);
+  }
+};
+
+static void test_start()
+{
+  fake_target_t target;
+  memif_t memif(&target);
+  target_stub_t stub(&memif);
+  memif.write_uint32(DRAM_BASE, PROGRAM_ENTRY);
+  memif.write_uint32(DRAM_BASE + 4, PROGRAM_ENTRY);
+
+  CHECK(stub.start(SCRATCH));
+  CHECK(stub.running());
+  CHECK(target.msip_writes == 1);
+  CHECK(target.jump_target == SCRATCH + STUB_CODE);
+  // the monitor starts by masking interrupts: csrrci s1, mstatus, 8
+  CHECK(target.load32(SCRATCH + STUB_CODE) == 0x300474f3);
+  CHECK(target.load32(DRAM_BASE) == PROGRAM_ENTRY);
+  CHECK(target.load32(DRAM_BASE + 4) == PROGRAM_ENTRY);
+  CHECK(stub.payload_base() > SCRATCH + STUB_CODE && stub.payload_base() % 64 == 0);
+}
+
+// Hart 0 never shows up: the MSIP is taken back and the program restored
+static void test_start_timeout()
+{
+  fake_target_t target;
+  memif_t memif(&target);
+  target_stub_t stub(&memif);
+  target.checks_in = false;
+  memif.write_uint32(DRAM_BASE, PROGRAM_ENTRY);
+
+  CHECK(!stub.start(SCRATCH));
+  CHECK(!stub.running());
+  CHECK(target.jump_target == SCRATCH + STUB_CODE);
+  CHECK(target.load32(CLINT_MSIP_BASE) == 0);
+  CHECK(target.load32(DRAM_BASE) == PROGRAM_ENTRY);
+}
+
+static void test_call()
+{
+  fake_target_t target;
+  memif_t memif(&target);
+  target_stub_t stub(&memif);
+  uint64_t result = 0;
+
+  CHECK(!stub.call(STUB_CMD_MEMSET, 0, 0, 0, &result));
+
+  CHECK(stub.start(SCRATCH));
+  CHECK(stub.call(STUB_CMD_CRC32, 0x100, 0x20, 0x3, &result));
+  CHECK(result == STUB_CMD_CRC32 + 0x123);
+  CHECK(stub.running());
+
+  // a hung monitor is given up on and not used again
+  target.monitor_answers = false;
+  CHECK(!stub.call(STUB_CMD_MEMSET, 0x100, 0x20, 0, &result));
+  CHECK(!stub.running());
+}
+
+// Reference LZ4 block decoder, byte by byte like the monitor
+static std::vector<uint8_t> lz4_decompress(const std::vector<uint8_t>& src)
+{
+  std::vector<uint8_t> out;
+  size_t pos = 0;
+  auto get_len = [&](size_t n) {
+    if (n == 15) {
+      uint8_t b;
+      do {
+        b = src.at(pos++);
+        n += b;
+      } while (b == 255);
+    }
+    return n;
+  };
+  while (pos < src.size()) {
+    uint8_t token = src[pos++];
+    size_t nlit = get_len(token >> 4);
+    out.insert(out.end(), src.begin() + pos, src.begin() + pos + nlit);
+    pos += nlit;
+    if (pos == src.size())
+      break;
+    size_t offset = src.at(pos) | src.at(pos + 1) << 8;
+    pos += 2;
+    size_t mlen = get_len(token & 15) + 4;
+    CHECK(offset && offset <= out.size());
+    if (!offset || offset > out.size())
+      break;
+    for (size_t i = 0; i < mlen; i++)
+      out.push_back(out[out.size() - offset]);
+  }
+  return out;
+}
+
+static void test_lz4_round_trip()
+{
+  srand(3);
+  for (int t = 0; t < 200; t++) {
+    std::vector<uint8_t> data(rand() % 70000);
+    // text-like runs, zero padding and noise
+    for (size_t i = 0; i < data.size(); ) {
+      size_t n = std::min(data.size() - i, (size_t)(1 + rand() % 600));
+      int kind = rand() % 3;
+      for (size_t j = 0; j < n; j++)
+        data[i + j] = kind == 0 ? 0 : kind == 1 ? "abcabd"[j % 6] : rand();
+      i += n;
+    }
+    auto packed = lz4_compress(data.data(), data.size());
+    CHECK(lz4_decompress(packed) == data);
+  }
+
+  std::vector<uint8_t> zeros(1 << 16, 0);
+  auto packed = lz4_compress(zeros.data(), zeros.size());
+  CHECK(packed.size() < 512);
+  CHECK(lz4_decompress(packed) == zeros);
+}
+
+// The zlib/IEEE check value. Unlike a plain sum, trailing zeros change it,
+// so a zero-filled extent that came up short is still caught.
+static void test_crc32()
+{
+  CHECK(crc32_checksum((const uint8_t*)"123456789", 9) == 0xcbf43926);
+  CHECK(crc32_checksum(NULL, 0) == 0);
+  std::vector<uint8_t> zeros(4096, 0);
+  CHECK(crc32_checksum(zeros.data(), zeros.size()) != crc32_checksum(zeros.data(), zeros.size() - 4));
+}
+
+int main()
+{
+  test_start();
+  test_start_timeout();
+  test_call();
+  test_lz4_round_trip();
+  test_crc32();
+
+  return test_result("target_stub_test");
+}
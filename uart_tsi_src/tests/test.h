@@ -0,0 +1,22 @@
+#ifndef __UART_TSI_TEST_H
+#define __UART_TSI_TEST_H
+
+#include <stdio.h>
+
+// Minimal checks for the tests under tests/, each test is its own program
+// and exits non-zero if any check failed
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+static int test_result(const char* name) {
+  printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+  return test_failures != 0;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include <fesvr/tsi.h>
+#include <vector>
+#include "test.h"
+
+// Pushes and copies that straddle the end of the buffer
+static void test_wraparound() {
+  tsi_ring_t ring(8);
+  for (uint32_t i = 0; i < 6; i++)
+    ring.push(i);
+  ring.consume(5);
+  CHECK(ring.size() == 1);
+  CHECK(ring.front() == 5);
+
+  // 5 words from index 6 land at 6, 7, then 0, 1, 2
+  uint32_t words[5] = { 10, 11, 12, 13, 14 };
+  ring.push_words(words, 5);
+  CHECK(ring.size() == 6);
+
+  const uint32_t* run;
+  size_t n = ring.peek_contiguous(&run);
+  CHECK(n == 3);
+  CHECK(run[0] == 5 && run[1] == 10 && run[2] == 11);
+
+  uint32_t all[6];
+  ring.copy(0, 6, all);
+  uint32_t expected[6] = { 5, 10, 11, 12, 13, 14 };
+  for (int i = 0; i < 6; i++)
+    CHECK(all[i] == expected[i]);
+
+  uint32_t tail[3];
+  ring.copy(2, 3, tail);
+  CHECK(tail[0] == 11 && tail[1] == 12 && tail[2] == 13);
+
+  // at() takes free-running indices
+  CHECK(ring.at(ring.head_index() + 3) == 12);
+  ring.at(ring.head_index() + 3) = 42;
+  ring.copy(3, 1, tail);
+  CHECK(tail[0] == 42);
+
+  ring.consume(3);
+  n = ring.peek_contiguous(&run);
+  CHECK(n == 3);
+  CHECK(run[0] == 42 && run[1] == 13 && run[2] == 14);
+}
+
+// Growing a wrapped ring keeps its order, and indices taken before still
+// name the same words
+static void test_growth() {
+  tsi_ring_t ring(4);
+  for (uint32_t i = 0; i < 3; i++)
+    ring.push(i);
+  ring.consume(2);
+  ring.push(3);
+  ring.push(4); // wraps
+  size_t index = ring.head_index() + 1;
+  CHECK(ring.at(index) == 3);
+
+  std::vector<uint32_t> burst(13);
+  for (size_t i = 0; i < burst.size(); i++)
+    burst[i] = 100 + i;
+  ring.push_words(burst.data(), burst.size());
+  CHECK(ring.size() == 16);
+  CHECK(ring.at(index) == 3);
+
+  std::vector<uint32_t> all(ring.size());
+  ring.copy(0, all.size(), all.data());
+  CHECK(all[0] == 2 && all[1] == 3 && all[2] == 4);
+  for (size_t i = 0; i < burst.size(); i++)
+    CHECK(all[3 + i] == 100 + i);
+}
+
+// A long run of pushes and consumes against a plain queue
+static void test_against_model() {
+  tsi_ring_t ring(4);
+  std::vector<uint32_t> model;
+  size_t model_head = 0;
+  uint32_t next = 0;
+  for (int step = 0; step < 10000; step++) {
+    size_t push = (step * 7) % 11;
+    std::vector<uint32_t> words(push);
+    for (auto& w : words)
+      w = next++;
+    ring.push_words(words.data(), words.size());
+    model.insert(model.end(), words.begin(), words.end());
+
+    size_t take = std::min<size_t>((step * 5) % 13, ring.size());
+    std::vector<uint32_t> got(take);
+    ring.copy(0, take, got.data());
+    for (size_t i = 0; i < take; i++)
+      CHECK(got[i] == model[model_head + i]);
+    ring.consume(take);
+    model_head += take;
+    CHECK(ring.size() == model.size() - model_head);
+  }
+}
+
+int main() {
+  test_wraparound();
+  test_growth();
+  test_against_model();
+  return test_result("tsi_ring_test");
+}
@@ -0,0 +1,349 @@
+#include <fesvr/tsi.h>
+#include <fesvr/host_task.h>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+#include "test.h"
+
+#define HEADER_WORDS (1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS)
+
+// A tsi_t without a transport, the tests play the target by inspecting the
+// queued words directly. Its host, once switched to, runs program() where
+// it would reset the target and then idles.
+class test_tsi_t : public tsi_t
+{
+ public:
+  test_tsi_t(int argc, char** argv) : tsi_t(argc, argv), program_done(false), idles(0) {}
+
+  using tsi_t::write_chunk;
+  using tsi_t::write_barrier;
+  using tsi_t::read_chunks;
+  using tsi_t::transfer_chunks;
+
+  std::vector<uint32_t> queued()
+  {
+    std::vector<uint32_t> words(words_queued());
+    copy_words(0, words.size(), words.data());
+    return words;
+  }
+
+  void drop_queued() { consume_words(words_queued()); }
+
+  std::function<void()> program;
+  bool program_done;
+  size_t idles;
+
+ protected:
+  void reset() override
+  {
+    if (program)
+      program();
+    program_done = true;
+  }
+
+  void idle() override
+  {
+    idles++;
+    switch_to_target();
+  }
+};
+
+static test_tsi_t* make_tsi(const char* chunk_arg, const char* depth_arg = "+tsi_read_depth=1")
+{
+  static const char* argv[] = { "tsi_test", "+permissive", 0, 0, "+permissive-off", "none" };
+  argv[2] = chunk_arg;
+  argv[3] = depth_arg;
+  return new test_tsi_t(6, (char**)argv);
+}
+
+static uint32_t target_word(addr_t addr) { return (uint32_t)addr * 3 + 1; }
+
+// Answers the oldest queued read, which must be at the front. Returns the
+// number of read commands that were queued.
+static size_t answer_read(test_tsi_t* tsi)
+{
+  auto words = tsi->queued();
+  CHECK(words.size() >= HEADER_WORDS && words.size() % HEADER_WORDS == 0);
+  if (words.size() < HEADER_WORDS || words[0] != SAI_CMD_READ)
+    return 0;
+
+  addr_t addr = words[1] | (addr_t)words[2] << 32;
+  size_t len = words[3] + 1;
+  tsi->consume_words(HEADER_WORDS);
+  std::vector<uint32_t> reply(len);
+  for (size_t i = 0; i < len; i++)
+    reply[i] = target_word(addr + 4 * i);
+  tsi->send_words(reply.data(), len);
+  return words.size() / HEADER_WORDS;
+}
+
+static bool is_write(const std::vector<uint32_t>& words, size_t at, addr_t addr, size_t len)
+{
+  return at + HEADER_WORDS + len <= words.size() &&
+    words[at] == SAI_CMD_WRITE &&
+    words[at + 1] == (uint32_t)addr && words[at + 2] == (uint32_t)(addr >> 32) &&
+    words[at + 3] == len - 1 && words[at + 4] == 0;
+}
+
+// Contiguous writes grow the queued command instead of adding one
+static void test_combine(test_tsi_t* tsi)
+{
+  uint32_t a[2] = { 1, 2 }, b[2] = { 3, 4 };
+  tsi->write_chunk(0x1000, 8, a);
+  tsi->write_chunk(0x1008, 8, b);
+
+  auto words = tsi->queued();
+  CHECK(words.size() == HEADER_WORDS + 4);
+  CHECK(is_write(words, 0, 0x1000, 4));
+  for (int i = 0; i < 4; i++)
+    CHECK(words[HEADER_WORDS + i] == (uint32_t)i + 1);
+  tsi->drop_queued();
+}
+
+// A gap, a barrier or the chunk size each start a new command
+static void test_split(test_tsi_t* tsi)
+{
+  uint32_t data[16] = { 0 };
+
+  tsi->write_chunk(0x1000, 4, data);
+  tsi->write_chunk(0x2000, 4, data);
+  auto words = tsi->queued();
+  CHECK(words.size() == 2 * (HEADER_WORDS + 1));
+  CHECK(is_write(words, 0, 0x1000, 1));
+  CHECK(is_write(words, HEADER_WORDS + 1, 0x2000, 1));
+  tsi->drop_queued();
+
+  tsi->write_chunk(0x3000, 4, data);
+  tsi->write_barrier();
+  tsi->write_chunk(0x3004, 4, data);
+  words = tsi->queued();
+  CHECK(words.size() == 2 * (HEADER_WORDS + 1));
+  CHECK(is_write(words, 0, 0x3000, 1));
+  CHECK(is_write(words, HEADER_WORDS + 1, 0x3004, 1));
+  tsi->drop_queued();
+
+  // 48 + 32 bytes would exceed the 64-byte chunk, 48 + 16 does not
+  tsi->write_chunk(0x4000, 48, data);
+  tsi->write_chunk(0x4030, 16, data);
+  tsi->write_chunk(0x4040, 32, data);
+  words = tsi->queued();
+  CHECK(words.size() == 2 * HEADER_WORDS + 16 + 8);
+  CHECK(is_write(words, 0, 0x4000, 16));
+  CHECK(is_write(words, HEADER_WORDS + 16, 0x4040, 8));
+  tsi->drop_queued();
+}
+
+// Once the transport took the header, the length can no longer change
+static void test_sent_header(test_tsi_t* tsi)
+{
+  uint32_t data[2] = { 5, 6 };
+  tsi->write_chunk(0x5000, 4, data);
+  tsi->consume_words(1);
+  tsi->write_chunk(0x5004, 4, data + 1);
+
+  auto words = tsi->queued();
+  CHECK(words.size() == HEADER_WORDS - 1 + 1 + HEADER_WORDS + 1);
+  CHECK(words[2] == 0); // the first command's length is still one word
+  CHECK(is_write(words, HEADER_WORDS, 0x5004, 1));
+  CHECK(words.back() == 6);
+  tsi->drop_queued();
+}
+
+// read_chunks keeps read_depth commands in flight and reassembles the data
+static void test_read_pipelining(test_tsi_t* tsi)
+{
+  std::vector<uint32_t> data(64);
+  tsi->program = [&] { tsi->read_chunks(0x8000, data.size() * sizeof(uint32_t), data.data()); };
+  tsi->switch_to_host();
+
+  size_t reads = 0, max_outstanding = 0;
+  while (!tsi->program_done) {
+    size_t outstanding = answer_read(tsi);
+    if (!outstanding)
+      break;
+    reads++;
+    max_outstanding = std::max(max_outstanding, outstanding);
+    tsi->switch_to_host();
+  }
+
+  CHECK(tsi->program_done);
+  CHECK(reads == 4); // 256 bytes in 64-byte chunks
+  CHECK(max_outstanding == 2);
+  CHECK(tsi->words_queued() == 0);
+  for (size_t i = 0; i < data.size(); i++)
+    CHECK(data[i] == target_word(0x8000 + 4 * i));
+}
+
+// The reads of a transfer that fits the read window are all queued, with
+// the writes between them, before the first reply is waited for
+static void test_transfer_batching(test_tsi_t* tsi)
+{
+  uint32_t first[4], second[4], data[2] = { 7, 8 };
+  std::vector<chunk_op_t> ops = {
+    { false, 0x100, sizeof(first), (uint8_t*)first },
+    { true, 0x200, sizeof(data), (uint8_t*)data },
+    { false, 0x300, sizeof(second), (uint8_t*)second },
+  };
+  tsi->program = [&] { tsi->transfer_chunks(ops); };
+  tsi->switch_to_host();
+
+  auto words = tsi->queued();
+  CHECK(words.size() == 3 * HEADER_WORDS + 2);
+  CHECK(!tsi->program_done);
+  if (words.size() != 3 * HEADER_WORDS + 2)
+    return;
+  CHECK(words[0] == SAI_CMD_READ && words[1] == 0x100);
+  CHECK(is_write(words, HEADER_WORDS, 0x200, 2));
+  CHECK(words[2 * HEADER_WORDS + 2] == SAI_CMD_READ && words[2 * HEADER_WORDS + 3] == 0x300);
+
+  tsi->drop_queued();
+  std::vector<uint32_t> reply;
+  for (int i = 0; i < 4; i++)
+    reply.push_back(target_word(0x100 + 4 * i));
+  for (int i = 0; i < 4; i++)
+    reply.push_back(target_word(0x300 + 4 * i));
+  tsi->send_words(reply.data(), reply.size());
+  tsi->switch_to_host();
+
+  CHECK(tsi->program_done);
+  for (int i = 0; i < 4; i++) {
+    CHECK(first[i] == target_word(0x100 + 4 * i));
+    CHECK(second[i] == target_word(0x300 + 4 * i));
+  }
+}
+
+// The host is not entered while the reply it awaits is short of words,
+// and is once the last one is in. Hosts that are idling are resumed on
+// every call.
+static void test_resume_on_data(test_tsi_t* tsi)
+{
+  uint32_t data[4] = { 0 };
+  tsi->program = [&] { tsi->memif().read(0x400, sizeof(data), data); };
+  CHECK(tsi->host_runnable());
+  tsi->switch_to_host();
+  CHECK(!tsi->program_done);
+  CHECK(!tsi->host_runnable());
+
+  auto words = tsi->queued();
+  CHECK(words.size() == HEADER_WORDS && words[0] == SAI_CMD_READ && words[3] == 3);
+  tsi->drop_queued();
+  uint32_t reply[4];
+  for (int i = 0; i < 4; i++)
+    reply[i] = target_word(0x400 + 4 * i);
+  tsi->send_words(reply, 3);
+  for (int i = 0; i < 3; i++) {
+    CHECK(!tsi->host_runnable());
+    tsi->switch_to_host();
+  }
+  CHECK(!tsi->program_done && data[0] == 0);
+
+  tsi->send_words(reply + 3, 1);
+  CHECK(tsi->host_runnable());
+  tsi->switch_to_host();
+  CHECK(tsi->program_done);
+  CHECK(memcmp(data, reply, sizeof(data)) == 0);
+
+  // run() has nothing to poll under "none", so it idles from here on
+  size_t idles = tsi->idles;
+  CHECK(idles == 1);
+  for (int i = 0; i < 5; i++) {
+    CHECK(tsi->host_runnable());
+    tsi->switch_to_host();
+  }
+  CHECK(tsi->idles == idles + 5);
+}
+
+// An exception out of the host reaches the target side once, after which
+// the host is done
+static void test_host_error(test_tsi_t* tsi)
+{
+  tsi->program = [] { throw std::runtime_error("host failed"); };
+  bool thrown = false;
+  try {
+    tsi->switch_to_host();
+  } catch (std::runtime_error& e) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  CHECK(tsi->host_task()->done());
+  CHECK(!tsi->host_runnable());
+  tsi->switch_to_host();
+}
+
+// One thread runs the hosts of several chips, each resumed only once the
+// replies it awaits are in
+static void test_multiplexed_hosts()
+{
+  const int nchips = 3;
+  test_tsi_t* chips[nchips];
+  std::vector<uint32_t> data[nchips];
+  host_scheduler_t scheduler;
+  for (int c = 0; c < nchips; c++) {
+    test_tsi_t* tsi = chips[c] = make_tsi("+tsi_chunk=64", "+tsi_read_depth=2");
+    std::vector<uint32_t>* buf = &data[c];
+    buf->resize(32 << c);
+    addr_t addr = 0x10000 * (c + 1);
+    tsi->program = [=] { tsi->memif().read(addr, buf->size() * sizeof(uint32_t), buf->data()); };
+    scheduler.add(tsi->host_task());
+  }
+
+  CHECK(scheduler.poll() == nchips);
+  CHECK(scheduler.poll() == 0); // all awaiting replies
+
+  // answering one chip resumes that chip alone
+  answer_read(chips[1]);
+  CHECK(scheduler.poll() == 1);
+  CHECK(scheduler.poll() == 0);
+
+  for (int rounds = 0; rounds < 100; rounds++) {
+    bool all_done = true;
+    for (auto tsi : chips) {
+      if (tsi->words_queued())
+        answer_read(tsi);
+      all_done = all_done && tsi->program_done;
+    }
+    if (all_done)
+      break;
+    scheduler.poll();
+  }
+
+  for (int c = 0; c < nchips; c++) {
+    CHECK(chips[c]->program_done);
+    CHECK(chips[c]->words_queued() == 0);
+    for (size_t i = 0; i < data[c].size(); i++)
+      CHECK(data[c][i] == target_word(0x10000 * (c + 1) + 4 * i));
+  }
+  // idling hosts are resumed on every poll
+  CHECK(scheduler.poll() == nchips);
+  CHECK(!scheduler.done());
+
+  for (auto tsi : chips)
+    delete tsi;
+}
+
+int main()
+{
+  test_tsi_t* tsi = make_tsi("+tsi_chunk=64");
+  test_combine(tsi);
+  test_split(tsi);
+  test_sent_header(tsi);
+  delete tsi;
+
+  // each host runs its program once
+  tsi = make_tsi("+tsi_chunk=64", "+tsi_read_depth=2");
+  test_read_pipelining(tsi);
+  delete tsi;
+  tsi = make_tsi("+tsi_chunk=64", "+tsi_read_depth=2");
+  test_transfer_batching(tsi);
+  delete tsi;
+  tsi = make_tsi("+tsi_chunk=64");
+  test_resume_on_data(tsi);
+  delete tsi;
+  tsi = make_tsi("+tsi_chunk=64");
+  test_host_error(tsi);
+  delete tsi;
+
+  test_multiplexed_hosts();
+
+  return test_result("tsi_test");
+}
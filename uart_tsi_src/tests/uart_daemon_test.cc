@@ -0,0 +1,199 @@
+#include "../uart_daemon.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdexcept>
+#include "test.h"
+
+// Jobs understood by the test daemon, which runs in a child process
+static int run_job(const std::vector<std::string>& args) {
+  if (args.empty())
+    return 100;
+  if (args[0] == "echo") {
+    char cwd[PATH_MAX];
+    printf("%s", getcwd(cwd, sizeof(cwd)) ? cwd : "?");
+    for (size_t i = 1; i < args.size(); i++)
+      printf(" %s", args[i].c_str());
+    return 7;
+  }
+  if (args[0] == "fds") {
+    // open descriptors, not counting the one opendir adds
+    int n = -1;
+    if (DIR* dir = opendir("/proc/self/fd")) {
+      while (readdir(dir))
+        n++;
+      closedir(dir);
+    }
+    return n - 2;
+  }
+  if (args[0] == "chatter") {
+    // outlives its client, then writes into the pipe it left behind
+    usleep(200 * 1000);
+    for (int i = 0; i < 1000; i++)
+      printf("chatter %d\n", i);
+    return 0;
+  }
+  if (args[0] == "throw")
+    throw std::runtime_error("job failed");
+  if (args[0] == "stop") {
+    uart_daemon_stop();
+    return 0;
+  }
+  return 101;
+}
+
+static std::string sock_path;
+
+static pid_t start_daemon() {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    _exit(uart_daemon_serve(sock_path, run_job));
+  }
+  for (int i = 0; i < 100 && access(sock_path.c_str(), F_OK) != 0; i++)
+    usleep(10 * 1000);
+  return pid;
+}
+
+// Submits a job with stdout going to a pipe, returns its exit code and
+// what it printed
+static int submit_captured(const std::vector<std::string>& args, std::string* out) {
+  int pipefd[2];
+  CHECK(pipe(pipefd) == 0);
+  fflush(stdout);
+  int saved = dup(1);
+  dup2(pipefd[1], 1);
+  close(pipefd[1]);
+  int exit_code = uart_daemon_submit(sock_path, args);
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+
+  char buf[4096];
+  ssize_t n;
+  out->clear();
+  while ((n = read(pipefd[0], buf, sizeof(buf))) > 0)
+    out->append(buf, n);
+  close(pipefd[0]);
+  return exit_code;
+}
+
+// Sends a job by hand: a length, then the payload, with nfds descriptors
+// attached to the length. Returns the connection.
+static int send_raw(uint32_t len, const char* payload, size_t payload_len, const int* fds, int nfds) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock_path.c_str());
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+
+  char control[CMSG_SPACE(sizeof(int) * 4)] = {};
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+  CHECK(sendmsg(sock, &msg, 0) == sizeof(len));
+  // may fail, the daemon can drop the job on its header alone
+  if (payload_len && write(sock, payload, payload_len) < 0)
+    CHECK(errno == EPIPE || errno == ECONNRESET);
+  return sock;
+}
+
+// The daemon hangs up on a job it drops, without an exit code. Closing
+// with our payload still unread resets the connection instead.
+static bool dropped(int sock) {
+  shutdown(sock, SHUT_WR);
+  int32_t exit_code;
+  ssize_t n = read(sock, &exit_code, sizeof(exit_code));
+  close(sock);
+  return n == 0 || (n < 0 && errno == ECONNRESET);
+}
+
+// Jobs run in the submitter's directory with its args and stdout
+static void test_round_trip() {
+  std::string out;
+  CHECK(submit_captured({ "echo", "a", "b c" }, &out) == 7);
+  char cwd[PATH_MAX];
+  CHECK(getcwd(cwd, sizeof(cwd)) && out == std::string(cwd) + " a b c");
+
+  CHECK(submit_captured({ "throw" }, &out) == 1);
+  CHECK(submit_captured({ "nonsense" }, &out) == 101);
+}
+
+// Malformed jobs are dropped and leave no descriptors behind
+static void test_malformed_jobs() {
+  std::string out;
+  int fds_before = submit_captured({ "fds" }, &out);
+  int fds[3] = { 0, 1, 2 };
+
+  // no NUL at the end of the payload
+  CHECK(dropped(send_raw(4, "/tmp", 4, fds, 3)));
+  // empty payload
+  CHECK(dropped(send_raw(0, "", 0, fds, 3)));
+  // too few descriptors
+  CHECK(dropped(send_raw(5, "/tmp", 5, fds, 2)));
+  // none at all
+  CHECK(dropped(send_raw(5, "/tmp", 5, fds, 0)));
+  // payload cut short by the client hanging up
+  CHECK(dropped(send_raw(100, "/tmp", 5, fds, 3)));
+
+  CHECK(submit_captured({ "fds" }, &out) == fds_before);
+}
+
+// A client that goes away mid-job fails neither the daemon nor later jobs
+static void test_client_disconnect() {
+  int pipefd[2];
+  CHECK(pipe(pipefd) == 0);
+  int fds[3] = { 0, pipefd[1], pipefd[1] };
+  const char job[] = "/tmp\0chatter";
+  int sock = send_raw(sizeof(job), job, sizeof(job), fds, 3);
+  close(pipefd[0]);
+  close(pipefd[1]);
+  close(sock);
+
+  std::string out;
+  CHECK(submit_captured({ "echo", "still", "here" }, &out) == 7);
+}
+
+int main() {
+  char dir[] = "/tmp/uart_daemon_test.XXXXXX";
+  CHECK(mkdtemp(dir) != NULL);
+  sock_path = std::string(dir) + "/d.sock";
+
+  pid_t daemon = start_daemon();
+  // only now, the daemon has to ignore SIGPIPE by itself
+  signal(SIGPIPE, SIG_IGN);
+  test_round_trip();
+  test_malformed_jobs();
+  test_client_disconnect();
+
+  std::string out;
+  CHECK(submit_captured({ "stop" }, &out) == 0);
+  int status;
+  CHECK(waitpid(daemon, &status, 0) == daemon);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(access(sock_path.c_str(), F_OK) != 0);
+  rmdir(dir);
+
+  return test_result("uart_daemon_test");
+}
@@ -0,0 +1,334 @@
+#include "../testchip_uart_tsi.h"
+#include <fesvr/host_task.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <map>
+#include <thread>
+#include <vector>
+#include "test.h"
+
+#define HEADER_WORDS (1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS)
+#define CHUNK 64
+
+static uint32_t target_word(addr_t addr) { return (uint32_t)addr * 3 + 1; }
+
+// Word-addressed target memory, shared by every link into it
+static std::map<addr_t, uint32_t> target_mem;
+
+static uint32_t load_word(addr_t addr)
+{
+  auto it = target_mem.find(addr);
+  return it == target_mem.end() ? target_word(addr) : it->second;
+}
+
+// The target end of a link, a TSI bridge that runs the commands it has
+// been sent in order
+struct fake_link_t {
+  int fd;
+  std::vector<uint32_t> words; // received, not yet a whole command
+  std::vector<uint8_t> partial; // a word cut short
+  size_t reads;
+  size_t reply_words;
+
+  fake_link_t(int fd) : fd(fd), reads(0), reply_words(0) {}
+
+  void service()
+  {
+    uint8_t buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+      partial.insert(partial.end(), buf, buf + n);
+    size_t whole = partial.size() & ~(sizeof(uint32_t) - 1);
+    for (size_t i = 0; i < whole; i += sizeof(uint32_t)) {
+      uint32_t word;
+      memcpy(&word, &partial[i], sizeof(word));
+      words.push_back(word);
+    }
+    partial.erase(partial.begin(), partial.begin() + whole);
+
+    size_t pos = 0;
+    while (words.size() - pos >= HEADER_WORDS) {
+      const uint32_t* cmd = &words[pos];
+      addr_t addr = cmd[1] | (addr_t)cmd[2] << 32;
+      size_t len = cmd[3] + 1;
+      if (cmd[0] == SAI_CMD_WRITE) {
+        if (words.size() - pos < HEADER_WORDS + len)
+          break;
+        for (size_t i = 0; i < len; i++)
+          target_mem[addr + 4 * i] = cmd[HEADER_WORDS + i];
+        pos += HEADER_WORDS + len;
+      } else {
+        std::vector<uint32_t> reply(len);
+        for (size_t i = 0; i < len; i++)
+          reply[i] = load_word(addr + 4 * i);
+        CHECK(write(fd, reply.data(), len * sizeof(uint32_t)) == (ssize_t)(len * sizeof(uint32_t)));
+        reads++;
+        reply_words += len;
+        pos += HEADER_WORDS;
+      }
+    }
+    words.erase(words.begin(), words.begin() + pos);
+  }
+};
+
+// A pty for the constructor to open as its tty. Returns the master end.
+static int open_pty(std::string* slave)
+{
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+  *slave = ptsname(master);
+  return master;
+}
+
+static testchip_uart_tsi_t* make_uart_tsi(const std::string& tty, const char* plusarg = "+tsi_chunk=64")
+{
+  static const char* argv[] = { "uart_tsi_test", "+permissive", "+tsi_chunk=64", 0, "+permissive-off", "none" };
+  argv[3] = plusarg;
+  return new testchip_uart_tsi_t(6, (char**)argv, (char*)tty.c_str(), 115200, false, false);
+}
+
+struct uart_tsi_test {
+  // Replaces the tsi's links with socketpairs whose other ends are returned
+  static std::vector<fake_link_t> fake_links(testchip_uart_tsi_t* tsi, size_t n)
+  {
+    std::vector<fake_link_t> targets;
+    for (size_t i = 0; i < n; i++) {
+      int sv[2];
+      CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+      for (int fd : sv)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      testchip_uart_tsi_t::uart_link_t link = {};
+      link.fd = sv[0];
+      tsi->links.push_back(link);
+      targets.push_back(fake_link_t(sv[1]));
+    }
+    tsi->set_read_depth(2 * n);
+    return targets;
+  }
+
+  // Runs the transport and the targets until the host is done. Links are
+  // serviced last to first, so that whatever a link may overtake, it does.
+  static bool run(testchip_uart_tsi_t* tsi, host_task_t& host, bool& done, std::vector<fake_link_t>& targets)
+  {
+    for (int i = 0; i < 1000 && !done; i++) {
+      host.poll();
+      tsi->handle_uart();
+      for (size_t l = targets.size(); l-- > 0; )
+        targets[l].service();
+    }
+    return done;
+  }
+
+  // Striped writes and reads of overlapping bytes across two links land in
+  // issue order. Reads wait for the other link's writes, whose fence
+  // replies are dropped, and the replies reach tsi_t in order.
+  static void test_striped_ordering()
+  {
+    target_mem.clear();
+    std::string tty;
+    int master = open_pty(&tty);
+    testchip_uart_tsi_t* tsi = make_uart_tsi(tty);
+    std::vector<fake_link_t> targets = fake_links(tsi, 2);
+
+    uint32_t first[64], second[16], back[64];
+    for (int i = 0; i < 64; i++)
+      first[i] = 0x10000 + i;
+    for (int i = 0; i < 16; i++)
+      second[i] = 0x20000 + i;
+
+    bool done = false, drained = false;
+    host_task_t host;
+    host.start([&] {
+      tsi->set_striping(true);
+      // chunk by chunk on links 0, 1, 0, 1
+      for (int c = 0; c < 4; c++)
+        tsi->write_chunk(0x1000 + c * CHUNK, CHUNK, first + c * 16);
+      // on link 0, over bytes link 1 has just written
+      tsi->write_chunk(0x1020, sizeof(second), second);
+      // striped too, and switches striping back off once all of it is in
+      tsi->read_chunks(0x1000, sizeof(back), back);
+      drained = !tsi->striping && tsi->expected_replies.empty();
+      done = true;
+    });
+    CHECK(run(tsi, host, done, targets));
+    CHECK(drained);
+
+    std::vector<uint32_t> expect(first, first + 64);
+    std::copy(second, second + 16, expect.begin() + 8);
+    CHECK(std::vector<uint32_t>(back, back + 64) == expect);
+    for (int i = 0; i < 64; i++)
+      CHECK(load_word(0x1000 + 4 * i) == expect[i]);
+
+    // Both links took reads, and answered more words than tsi_t asked for:
+    // the difference is the fences, which must not have reached it
+    CHECK(targets[0].reads > 0 && targets[1].reads > 0);
+    size_t answered = targets[0].reply_words + targets[1].reply_words;
+    CHECK(answered > 64);
+    CHECK(tsi->get_stats().words_received == 64);
+    CHECK(tsi->reply_words_pending() == 0);
+
+    delete tsi;
+    for (auto& t : targets)
+      close(t.fd);
+    close(master);
+  }
+
+  // A switch waits for every command before it, on every link, and the
+  // commands after it go out on link 0 alone
+  static void test_stripe_switch_drain()
+  {
+    target_mem.clear();
+    std::string tty;
+    int master = open_pty(&tty);
+    testchip_uart_tsi_t* tsi = make_uart_tsi(tty);
+    std::vector<fake_link_t> targets = fake_links(tsi, 2);
+
+    uint32_t data[16];
+    for (int i = 0; i < 16; i++)
+      data[i] = 0x30000 + i;
+    bool done = false, drained = false;
+    size_t link1_reads = 0;
+    host_task_t host;
+    host.start([&] {
+      tsi->set_striping(true);
+      tsi->write_chunk(0x2040, sizeof(data), data); // link 1
+      tsi->set_striping(false);
+      drained = tsi->expected_replies.empty() && !tsi->links[1].dirty;
+      link1_reads = targets[1].reads;
+      uint32_t word;
+      tsi->read_chunks(0x2040, sizeof(word), &word);
+      CHECK(word == data[0]);
+      done = true;
+    });
+    CHECK(run(tsi, host, done, targets));
+    CHECK(drained);
+    CHECK(link1_reads == 1); // the fence of its write
+    CHECK(targets[1].reads == link1_reads);
+    CHECK(targets[0].reads == 1);
+    CHECK(tsi->get_stats().words_received == 1);
+
+    delete tsi;
+    for (auto& t : targets)
+      close(t.fd);
+    close(master);
+  }
+
+  // RTS/CTS is set on ttys and refused by anything else
+  static void test_set_flow_control()
+  {
+    std::string tty;
+    int master = open_pty(&tty);
+    int fd = open(tty.c_str(), O_RDWR | O_NOCTTY);
+    CHECK(testchip_uart_tsi_t::set_flow_control(fd));
+    struct termios t;
+    CHECK(tcgetattr(fd, &t) == 0 && (t.c_cflag & CRTSCTS));
+    close(fd);
+    close(master);
+
+    int pipefd[2];
+    CHECK(pipe(pipefd) == 0);
+    CHECK(!testchip_uart_tsi_t::set_flow_control(pipefd[1]));
+    close(pipefd[0]);
+    close(pipefd[1]);
+  }
+
+  // With +flowctl=rts the tty is non-blocking. write_bytes waits out every
+  // write the tty only takes part of, counts it, and delivers all of the
+  // bytes in order.
+  static void test_write_stalls()
+  {
+    std::string tty;
+    int master = open_pty(&tty);
+    testchip_uart_tsi_t* tsi = make_uart_tsi(tty, "+flowctl=rts");
+    CHECK(tsi->flow_control);
+    CHECK(fcntl(tsi->ttyfd, F_GETFL, 0) & O_NONBLOCK);
+
+    std::vector<uint8_t> sent(1 << 20), received;
+    for (size_t i = 0; i < sent.size(); i++)
+      sent[i] = i ^ (i >> 8) ^ (i >> 16);
+    // a target slower than the host
+    std::thread target([&] {
+      uint8_t buf[4096];
+      while (received.size() < sent.size()) {
+        usleep(100);
+        struct pollfd p = { master, POLLIN, 0 };
+        if (poll(&p, 1, 2000) <= 0)
+          break;
+        ssize_t n = read(master, buf, sizeof(buf));
+        if (n <= 0)
+          break;
+        received.insert(received.end(), buf, buf + n);
+      }
+    });
+    tsi->write_bytes(sent.data(), sent.size());
+    target.join();
+
+    CHECK(received == sent);
+    CHECK(tsi->tx_stalls > 0);
+    CHECK(tsi->tx_cts_stalls == 0); // a pty has no CTS line to report
+    CHECK(tsi->tx_stall_time > 0);
+
+    delete tsi;
+    close(master);
+  }
+
+  // Links whose send queues outgrow what the socket takes stall and catch
+  // up, with the writes still landing in order
+  static void test_link_stalls()
+  {
+    target_mem.clear();
+    std::string tty;
+    int master = open_pty(&tty);
+    testchip_uart_tsi_t* tsi = make_uart_tsi(tty);
+    std::vector<fake_link_t> targets = fake_links(tsi, 2);
+    tsi->flow_control = true;
+
+    // twice over, so that the second pass has to land after the first
+    std::vector<uint32_t> data(1 << 18);
+    bool done = false;
+    host_task_t host;
+    host.start([&] {
+      tsi->set_striping(true);
+      for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < data.size(); i++)
+          data[i] = pass << 24 | i;
+        for (size_t at = 0; at < data.size(); at += CHUNK / 4)
+          tsi->write_chunk(0x100000 + 4 * at, CHUNK, &data[at]);
+      }
+      tsi->set_striping(false);
+      done = true;
+    });
+    CHECK(run(tsi, host, done, targets));
+
+    CHECK(tsi->tx_stalls > 0);
+    CHECK(tsi->tx_stall_time > 0);
+    for (auto& l : tsi->links)
+      CHECK(!l.stalled && l.tx.empty());
+    bool in_order = true;
+    for (size_t i = 0; i < data.size(); i++)
+      in_order = in_order && load_word(0x100000 + 4 * i) == (1 << 24 | i);
+    CHECK(in_order);
+
+    delete tsi;
+    for (auto& t : targets)
+      close(t.fd);
+    close(master);
+  }
+};
+
+int main()
+{
+  uart_tsi_test::test_striped_ordering();
+  uart_tsi_test::test_stripe_switch_drain();
+  uart_tsi_test::test_set_flow_control();
+  uart_tsi_test::test_write_stalls();
+  uart_tsi_test::test_link_stalls();
+
+  return test_result("uart_tsi_test");
+}
@@ -0,0 +1,40 @@
+#include "uart_trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <fesvr/tsi.h>
+
+// Prints a trace recorded with uart_tsi +trace=<file> as text. With -c only
+// the decoded commands are printed.
+int main(int argc, char* argv[]) {
+  bool commands_only = argc == 3 && strcmp(argv[1], "-c") == 0;
+  if (argc != 2 && !commands_only) {
+    printf("Usage: ./tsi_trace_dump [-c] <trace>\n");
+    return 1;
+  }
+
+  uart_trace_reader_t trace;
+  if (!trace.open(argv[argc - 1])) {
+    printf("Error: Could not read trace %s\n", argv[argc - 1]);
+    return 1;
+  }
+
+  for (size_t i = 0; i < trace.records.size(); i++) {
+    const uart_trace_record_t &rec = trace.records[i];
+    const uint32_t* words = &trace.words[trace.offsets[i]];
+    double ms = rec.time_ns / 1e6;
+    if (rec.type == UART_TRACE_CMD) {
+      uint64_t addr = words[1] | ((uint64_t) words[2] << 32);
+      uint64_t len = (words[3] | ((uint64_t) words[4] << 32)) + 1;
+      printf("%12.3f ms  %-5s %016lx %ld words\n", ms,
+             words[0] == SAI_CMD_WRITE ? "WRITE" : words[0] == SAI_CMD_READ ? "READ" : "???", addr, len);
+      continue;
+    }
+    if (commands_only)
+      continue;
+    printf("%12.3f ms  %s %u words\n", ms, rec.type == UART_TRACE_TX ? "TX" : "RX", rec.nwords);
+    for (uint32_t j = 0; j < rec.nwords; j++)
+      printf("%s%08x%s", j % 8 ? " " : "                 ", words[j], j % 8 == 7 || j + 1 == rec.nwords ? "\n" : "");
+  }
+  printf("%ld records, %ld TX and %ld RX words\n", trace.records.size(), trace.tx.size(), trace.rx.size());
+  return 0;
+}
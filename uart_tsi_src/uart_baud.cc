@@ -0,0 +1,40 @@
+#include "uart_baud.h"
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+#include <asm/termbits.h>
+
+bool uart_set_custom_baud(int fd, uint32_t baud_rate) {
+  struct termios2 tty2;
+  if (ioctl(fd, TCGETS2, &tty2) != 0)
+    return false;
+
+  tty2.c_cflag &= ~CBAUD;
+  tty2.c_cflag |= BOTHER;
+  tty2.c_ispeed = baud_rate;
+  tty2.c_ospeed = baud_rate;
+  if (ioctl(fd, TCSETS2, &tty2) != 0)
+    return false;
+
+  // Drivers round to the nearest divisor they support, read back what stuck
+  if (ioctl(fd, TCGETS2, &tty2) != 0)
+    return false;
+  uint32_t err = tty2.c_ospeed > baud_rate ? tty2.c_ospeed - baud_rate : baud_rate - tty2.c_ospeed;
+  return err <= baud_rate / 50; // UARTs tolerate roughly 2% of clock mismatch
+}
+
+#elif defined(__APPLE__)
+#include <IOKit/serial/ioss.h>
+
+bool uart_set_custom_baud(int fd, uint32_t baud_rate) {
+  speed_t speed = baud_rate;
+  return ioctl(fd, IOSSIOSPEED, &speed) == 0;
+}
+
+#else
+
+bool uart_set_custom_baud(int fd, uint32_t baud_rate) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __UART_BAUD_H
+#define __UART_BAUD_H
+
+#include <stdint.h>
+
+// Program an arbitrary (non-Bxxx) baud rate on an already configured tty.
+// Lives in its own file because the Linux termios2 definitions cannot be
+// included next to <termios.h>. Returns false if the OS or driver refused.
+bool uart_set_custom_baud(int fd, uint32_t baud_rate);
+
+#endif
@@ -0,0 +1,238 @@
+#include "uart_daemon.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// A job is one message: a 32-bit payload length, then the submitter's
+// working directory and its args as NUL-terminated strings. The submitter's
+// stdin, stdout and stderr ride along as SCM_RIGHTS on the length. The
+// daemon answers with the 32-bit exit code.
+#define UART_DAEMON_NFDS 3
+
+static volatile sig_atomic_t stop_serving = 0;
+
+static void handle_stop_signal(int) {
+  stop_serving = 1;
+}
+
+void uart_daemon_stop() {
+  stop_serving = 1;
+}
+
+// Without SA_RESTART, so that a signal also breaks out of accept(). Jobs
+// install their own handlers, so this is redone after each one. A client
+// that went away mid-job must not take the daemon with it, so writes to its
+// stdout or socket fail with EPIPE instead of raising SIGPIPE.
+static void catch_stop_signals() {
+  struct sigaction sa = {};
+  sa.sa_handler = handle_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+}
+
+static bool read_all(int fd, void* buf, size_t len) {
+  for (size_t got = 0; got < len; ) {
+    ssize_t n = read(fd, (char*)buf + got, len - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    got += n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void* buf, size_t len) {
+  for (size_t done = 0; done < len; ) {
+    ssize_t n = write(fd, (const char*)buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+static bool socket_address(const std::string& path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path)) {
+    printf("Error: Socket path %s is too long\n", path.c_str());
+    return false;
+  }
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+// Receives one job, returns false if the connection didn't carry a whole
+// one. Descriptors that did arrive with a bad job are closed.
+static bool receive_job(int fd, std::string& cwd, std::vector<std::string>& args, int* fds) {
+  uint32_t len;
+  char control[CMSG_SPACE(sizeof(int) * UART_DAEMON_NFDS)];
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(fd, &msg, MSG_WAITALL);
+
+  std::vector<int> received;
+  struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    received.resize((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(received.data(), CMSG_DATA(cmsg), received.size() * sizeof(int));
+  }
+
+  std::vector<char> payload;
+  if (n == sizeof(len) && received.size() == UART_DAEMON_NFDS) {
+    payload.resize(len);
+    if (read_all(fd, payload.data(), len) && len && payload.back() == '\0') {
+      for (size_t pos = 0; pos < len; pos += strlen(&payload[pos]) + 1)
+        args.push_back(&payload[pos]);
+    }
+  }
+  if (args.empty()) {
+    for (int received_fd : received)
+      close(received_fd);
+    return false;
+  }
+  memcpy(fds, received.data(), sizeof(int) * UART_DAEMON_NFDS);
+  cwd = args[0];
+  args.erase(args.begin());
+  return true;
+}
+
+int uart_daemon_serve(const std::string& path,
+                      std::function<int(const std::vector<std::string>&)> run_job) {
+  struct sockaddr_un addr;
+  if (!socket_address(path, &addr))
+    return 1;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path.c_str());
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0) {
+    printf("Error %i listening on %s: %s\n", errno, path.c_str(), strerror(errno));
+    return 1;
+  }
+  printf("Waiting for jobs on %s\n", path.c_str());
+  fflush(stdout);
+
+  char home[PATH_MAX];
+  if (!getcwd(home, sizeof(home)))
+    strcpy(home, "/");
+  int saved[UART_DAEMON_NFDS];
+  for (int i = 0; i < UART_DAEMON_NFDS; i++)
+    saved[i] = dup(i);
+
+  // Later connections wait in the listen backlog, so jobs run in order
+  catch_stop_signals();
+  while (!stop_serving) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR)
+        continue;
+      printf("Error %i from accept: %s\n", errno, strerror(errno));
+      break;
+    }
+    std::string cwd;
+    std::vector<std::string> args;
+    int fds[UART_DAEMON_NFDS];
+    if (!receive_job(conn, cwd, args, fds)) {
+      printf("Warning: Dropping malformed job\n");
+      close(conn);
+      continue;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < UART_DAEMON_NFDS; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
+    }
+    int32_t exit_code = 1;
+    if (chdir(cwd.c_str()) != 0) {
+      printf("Error %i changing to %s: %s\n", errno, cwd.c_str(), strerror(errno));
+    } else {
+      try {
+        exit_code = run_job(args);
+      } catch (std::exception& e) {
+        printf("Error: %s\n", e.what());
+      }
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < UART_DAEMON_NFDS; i++)
+      dup2(saved[i], i);
+    if (chdir(home) != 0)
+      printf("Warning: Could not return to %s\n", home);
+
+    printf("Job finished with exit code %d\n", exit_code);
+    fflush(stdout);
+    if (!write_all(conn, &exit_code, sizeof(exit_code)))
+      printf("Warning: Client left before its job finished\n");
+    close(conn);
+    catch_stop_signals();
+  }
+  printf("Stopping, no longer accepting jobs on %s\n", path.c_str());
+  close(sock);
+  unlink(path.c_str());
+  return 0;
+}
+
+int uart_daemon_submit(const std::string& path, const std::vector<std::string>& args) {
+  struct sockaddr_un addr;
+  if (!socket_address(path, &addr))
+    return 1;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    printf("Error %i connecting to %s: %s\n", errno, path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    printf("Error %i from getcwd: %s\n", errno, strerror(errno));
+    return 1;
+  }
+  std::vector<char> payload(cwd, cwd + strlen(cwd) + 1);
+  for (auto& arg : args)
+    payload.insert(payload.end(), arg.c_str(), arg.c_str() + arg.size() + 1);
+
+  uint32_t len = payload.size();
+  int fds[UART_DAEMON_NFDS] = { 0, 1, 2 };
+  char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // Output goes straight to our stdout, all that comes back is the exit code
+  int32_t exit_code;
+  fflush(stdout);
+  if (sendmsg(sock, &msg, 0) != sizeof(len) || !write_all(sock, payload.data(), len) ||
+      !read_all(sock, &exit_code, sizeof(exit_code))) {
+    printf("Error: Lost connection to %s\n", path.c_str());
+    return 1;
+  }
+  close(sock);
+  return exit_code;
+}
@@ -0,0 +1,26 @@
+#ifndef __UART_DAEMON_H
+#define __UART_DAEMON_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Runs jobs handed over on a Unix socket one at a time, so a board is never
+// shared. Each job runs in the job's working directory with the stdin,
+// stdout and stderr of the submitting process, and its exit code is sent
+// back. Jobs run inside the daemon so that they share its open ttys. A job
+// fails by throwing, which fails only that job; one that calls exit() or
+// abort() (or crashes) still ends the daemon, and its submitter then loses
+// the connection. A submitter that goes away mid-job doesn't: SIGPIPE is
+// ignored. SIGINT and SIGTERM stop the daemon: between jobs at once, during
+// a job once run_job has called uart_daemon_stop and returned.
+int uart_daemon_serve(const std::string& path,
+                      std::function<int(const std::vector<std::string>&)> run_job);
+
+// Has uart_daemon_serve return after the current job
+void uart_daemon_stop();
+
+// Submits args as a job and waits for it, returning its exit code
+int uart_daemon_submit(const std::string& path, const std::vector<std::string>& args);
+
+#endif
@@ -0,0 +1,144 @@
+#include "uart_trace.h"
+#include <string.h>
+#include <algorithm>
+#include <fesvr/tsi.h>
+
+// Must be a power of two. At 4 MB the ring holds seconds of traffic even on
+// the fastest links, so the writer thread only has to keep up on average.
+#define UART_TRACE_RING_BYTES (4 * 1024 * 1024)
+// Longer bursts are split into several records so that one always fits
+#define UART_TRACE_MAX_WORDS (64 * 1024)
+// How long the writer thread sleeps on an empty ring
+#define UART_TRACE_IDLE_US 1000
+
+uart_trace_writer_t::uart_trace_writer_t()
+  : file(NULL), stopping(false), head(0), tail(0), ring_waits(0),
+    cmd_words(0), cmd_data(0) {
+}
+
+uart_trace_writer_t::~uart_trace_writer_t() {
+  close();
+}
+
+bool uart_trace_writer_t::open(const std::string& path) {
+  file = fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  fwrite(UART_TRACE_MAGIC, 1, strlen(UART_TRACE_MAGIC), file);
+  ring.resize(UART_TRACE_RING_BYTES);
+  start = std::chrono::steady_clock::now();
+  writer = std::thread(&uart_trace_writer_t::drain, this);
+  return true;
+}
+
+void uart_trace_writer_t::close() {
+  if (!file)
+    return;
+  stopping = true;
+  writer.join();
+  fclose(file);
+  file = NULL;
+  if (ring_waits)
+    printf("Trace: the link waited on a full trace buffer %ld times\n", ring_waits);
+}
+
+void uart_trace_writer_t::tx(const uint32_t* words, size_t nwords) {
+  record(UART_TRACE_TX, words, nwords);
+
+  // Pick the command headers out of the stream, skipping write data
+  for (size_t i = 0; i < nwords; ) {
+    if (cmd_data) {
+      size_t skip = std::min<uint64_t>(cmd_data, nwords - i);
+      cmd_data -= skip;
+      i += skip;
+      continue;
+    }
+    cmd[cmd_words++] = words[i++];
+    if (cmd_words == 1 + SAI_ADDR_CHUNKS + SAI_LEN_CHUNKS) {
+      record(UART_TRACE_CMD, cmd, cmd_words);
+      if (cmd[0] == SAI_CMD_WRITE)
+        cmd_data = (cmd[3] | ((uint64_t) cmd[4] << 32)) + 1;
+      cmd_words = 0;
+    }
+  }
+}
+
+void uart_trace_writer_t::rx(const uint32_t* words, size_t nwords) {
+  record(UART_TRACE_RX, words, nwords);
+}
+
+void uart_trace_writer_t::record(uint32_t type, const uint32_t* words, size_t nwords) {
+  uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+  for (size_t pos = 0; pos < nwords; pos += UART_TRACE_MAX_WORDS) {
+    uart_trace_record_t rec = { now, type, (uint32_t) std::min<size_t>(UART_TRACE_MAX_WORDS, nwords - pos) };
+    size_t len = sizeof(rec) + rec.nwords * sizeof(uint32_t);
+    if (ring.size() - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire)) < len) {
+      ring_waits++;
+      while (ring.size() - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire)) < len)
+        std::this_thread::yield();
+    }
+    put(&rec, sizeof(rec));
+    put(words + pos, rec.nwords * sizeof(uint32_t));
+  }
+}
+
+// Copies into the ring at tail, which wraps into at most two segments, and
+// only then publishes the bytes to the writer thread
+void uart_trace_writer_t::put(const void* src, size_t len) {
+  size_t t = tail.load(std::memory_order_relaxed);
+  size_t pos = t & (ring.size() - 1);
+  size_t first = std::min(len, ring.size() - pos);
+  memcpy(&ring[pos], src, first);
+  memcpy(&ring[0], (const uint8_t*) src + first, len - first);
+  tail.store(t + len, std::memory_order_release);
+}
+
+void uart_trace_writer_t::drain() {
+  while (true) {
+    // Check for stopping before looking at tail, so that everything recorded
+    // before close() is still written out
+    bool stop = stopping.load();
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    if (h == t) {
+      if (stop)
+        break;
+      std::this_thread::sleep_for(std::chrono::microseconds(UART_TRACE_IDLE_US));
+      continue;
+    }
+    size_t pos = h & (ring.size() - 1);
+    size_t first = std::min(t - h, ring.size() - pos);
+    fwrite(&ring[pos], 1, first, file);
+    fwrite(&ring[0], 1, t - h - first, file);
+    head.store(t, std::memory_order_release);
+  }
+  fflush(file);
+}
+
+bool uart_trace_reader_t::open(const std::string& path) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  char magic[8];
+  bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+            memcmp(magic, UART_TRACE_MAGIC, sizeof(magic)) == 0;
+  uart_trace_record_t rec;
+  while (ok && fread(&rec, sizeof(rec), 1, f) == 1) {
+    size_t pos = words.size();
+    words.resize(pos + rec.nwords);
+    if (fread(&words[pos], sizeof(uint32_t), rec.nwords, f) != rec.nwords) {
+      ok = false; // cut off, e.g. by a crash while recording
+      words.resize(pos);
+      break;
+    }
+    records.push_back(rec);
+    offsets.push_back(pos);
+    if (rec.type == UART_TRACE_TX)
+      tx.insert(tx.end(), words.begin() + pos, words.end());
+    if (rec.type == UART_TRACE_RX)
+      rx.insert(rx.end(), words.begin() + pos, words.end());
+  }
+  fclose(f);
+  return ok || !records.empty();
+}
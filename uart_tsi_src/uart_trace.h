@@ -0,0 +1,83 @@
+#ifndef __UART_TRACE_H
+#define __UART_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Binary trace of the TSI word streams, for +trace= and +replay=. A trace is
+// an 8-byte magic followed by records of
+//   uint64 time (ns since the trace was opened), uint32 type, uint32 nwords,
+//   nwords 32-bit words
+// in host byte order. TX and RX records hold the words exactly as tsi_t
+// queued and received them, CMD records hold each command's 5-word header
+// as decoded from the TX stream.
+#define UART_TRACE_MAGIC "TSITRC01"
+#define UART_TRACE_TX 1
+#define UART_TRACE_RX 2
+#define UART_TRACE_CMD 3
+
+struct uart_trace_record_t {
+  uint64_t time_ns;
+  uint32_t type;
+  uint32_t nwords;
+};
+
+// Records are copied into a single-producer single-consumer ring and
+// written out by a background thread, so the link loop never waits on the
+// file unless the ring is full.
+class uart_trace_writer_t
+{
+public:
+  uart_trace_writer_t();
+  ~uart_trace_writer_t();
+
+  bool open(const std::string& path);
+  bool is_open() { return file != NULL; }
+  // Flushes everything recorded so far and closes the file
+  void close();
+
+  void tx(const uint32_t* words, size_t nwords);
+  void rx(const uint32_t* words, size_t nwords);
+
+private:
+  void record(uint32_t type, const uint32_t* words, size_t nwords);
+  void put(const void* src, size_t len);
+  void drain();
+
+  FILE* file;
+  std::thread writer;
+  std::atomic<bool> stopping;
+  std::chrono::steady_clock::time_point start;
+
+  // Byte ring, indices run free and are masked on access. Only the link
+  // loop advances tail and only the writer thread advances head.
+  std::vector<uint8_t> ring;
+  std::atomic<size_t> head;
+  std::atomic<size_t> tail;
+  uint64_t ring_waits; // records that found the ring full
+
+  // Decoder state for CMD records
+  uint32_t cmd[5];
+  size_t cmd_words; // header words collected
+  uint64_t cmd_data; // data words of the current write still to come
+};
+
+// A whole trace read back into its TX and RX streams
+class uart_trace_reader_t
+{
+public:
+  bool open(const std::string& path);
+
+  std::vector<uart_trace_record_t> records;
+  std::vector<size_t> offsets; // of each record's words in words
+  std::vector<uint32_t> words;
+  std::vector<uint32_t> tx;
+  std::vector<uint32_t> rx;
+};
+
+#endif
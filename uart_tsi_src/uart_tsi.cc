@@ -0,0 +1,160 @@
+#include "testchip_uart_tsi.h"
+#include "uart_daemon.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Add the permissive flags in manually here
+static std::vector<std::string> permissive_args(const std::vector<std::string>& raw) {
+  std::vector<std::string> args;
+  for (const std::string& arg : raw) {
+    bool is_plusarg = arg[0] == '+';
+    if (is_plusarg) {
+      args.push_back("+permissive");
+      args.push_back(arg);
+      args.push_back("+permissive-off");
+    } else {
+      args.push_back(arg);
+    }
+  }
+  return args;
+}
+
+// Runs one program. With +daemon= this runs once per job, and the ttys stay
+// open in between.
+static int run_tsi(const std::vector<std::string>& args, bool in_daemon) {
+  std::string tty;
+  bool verbose = false;
+  bool self_check = false;
+  uint64_t baud_rate = 115200;
+  for (const std::string& arg : args) {
+    if (arg.find("+tty=") == 0) {
+      tty = std::string(arg.c_str() + 5);
+    }
+    if (arg.find("+verbose") == 0) {
+      verbose = true;
+    }
+    if (arg.find("+selfcheck") == 0) {
+      self_check = true;
+    }
+    if (arg.find("+baudrate=") == 0) {
+      // 0 selects automatic probing
+      baud_rate = arg.substr(10) == "auto" ? 0 : strtoull(arg.substr(10).c_str(), 0, 10);
+    }
+  }
+
+  bool replay = std::any_of(args.begin(), args.end(), [](const std::string& arg) {
+    return arg.find("+replay=") == 0; });
+  if (tty.size() == 0 && !replay) {
+    printf("ERROR: Must use +tty=/dev/ttyxx to specify a tty\n");
+    return 1;
+  }
+
+  printf("Attempting to open TTY at %s\n", tty.c_str());
+  std::vector<std::string> tsi_args(args);
+  char* tsi_argv[args.size()];
+  for (size_t i = 0; i < args.size(); i++)
+    tsi_argv[i] = tsi_args[i].data();
+
+  testchip_uart_tsi_t tsi(args.size(), tsi_argv,
+			  tty.data(), baud_rate,
+			  verbose, self_check);
+  tsi.set_reset_before_load(in_daemon);
+  printf("Checking connection status with %s\n", tty.c_str());
+  if (!tsi.check_connection()) {
+    printf("Connection failed\n");
+    return 1;
+  } else {
+    printf("Connection succeeded\n");
+  }
+  while (!tsi.done()) {
+    tsi.switch_to_host();
+    tsi.handle_uart();
+  }
+  printf("Done, shutting down, flushing UART\n");
+  while (tsi.handle_uart()) {
+    tsi.switch_to_host();
+  }; // flush any inflight reads or writes
+  tsi.print_flow_control_stats();
+  tsi.report_stats();
+  if (!in_daemon)
+    printf("WARNING: You should probably reset the target before running this program again\n");
+  // The program never finished, don't let that pass for success
+  if (tsi.interrupted()) {
+    printf("Interrupted\n");
+    if (in_daemon)
+      uart_daemon_stop();
+    return 1;
+  }
+  return tsi.exit_code();
+}
+
+int main(int argc, char* argv[]) {
+  printf("Starting UART-based TSI\n");
+  printf("Usage: ./uart_tsi +tty=/dev/pts/xx <PLUSARGS> <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  <PLUSARGS> <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +no_hart0_msip +init_write=0x80000000:0xdeadbeef none\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +no_hart0_msip +init_read=0x80000000 none\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +selfcheck <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +selfcheck=full <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +baudrate=921600 <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +baudrate=auto [+probe_addr=0x10000] <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +tsi_read_depth=4 <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +tsi_chunk=4096 <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +tsi_chunk=auto <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +compress_load [+stub_addr=0x...] <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +image_cache[=<file>] <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx,/dev/ttyyy,...  <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +flowctl=rts +tsi_chunk=16384 <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +poll=backoff|interval:<us> <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +shadow <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +stats[=<file.json>] <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +trace=<file> <bin>\n");
+  printf("       ./uart_tsi +replay=<file> <PLUSARGS as recorded> <bin>\n");
+  printf("       ./uart_tsi +tty=/dev/ttyxx  +daemon=/path/to.sock +init_write=<reset register>:0x1\n");
+  printf("       ./uart_tsi +client=/path/to.sock <PLUSARGS> <bin>\n");
+  printf("Hint:  Use /dev/cu.xxx if using macOS, /dev/tty.xxx if using linux.\n");
+
+
+  std::vector<std::string> raw_args(argv, argv + argc);
+  for (std::string& arg : raw_args) {
+    if (arg.find("+client=") == 0) {
+      // The daemon owns the tty, everything else describes the job
+      std::vector<std::string> job;
+      for (int i = 1; i < argc; i++)
+        if (raw_args[i].find("+client=") != 0)
+          job.push_back(raw_args[i]);
+      return uart_daemon_submit(arg.substr(8), job);
+    }
+  }
+
+  std::vector<std::string> args = permissive_args(raw_args);
+  for (std::string& arg : raw_args) {
+    if (arg.find("+daemon=") == 0) {
+      // The daemon's own plusargs apply to every job, and its +init_write=
+      // accesses run before each load as well as at boot. A job must not
+      // land on a target still running the last one, and an MSIP can't
+      // stop a running hart, so one of them has to reset the target.
+      if (std::none_of(args.begin(), args.end(), [](const std::string& a) {
+            return a.find("+init_write=") == 0; })) {
+        printf("Error: +daemon= needs an +init_write= that resets the target, e.g. +init_write=<reset register>:0x1\n");
+        return 1;
+      }
+      return uart_daemon_serve(arg.substr(8), [&args](const std::vector<std::string>& job) {
+        std::vector<std::string> job_args(args);
+        for (const std::string& job_arg : permissive_args(job))
+          job_args.push_back(job_arg);
+        return run_tsi(job_args, true);
+      });
+    }
+  }
+  try {
+    return run_tsi(args, false);
+  } catch (std::exception& e) {
+    printf("Error: %s\n", e.what());
+    return 1;
+  }
+}